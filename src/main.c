@@ -1,21 +1,77 @@
+#define _GNU_SOURCE
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <termios.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdint.h>
+#include <dirent.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "code_table.h"
 
 #define BUFFER_SIZE 10
 #define UTF8_MAX_BYTE 6
 #define MBCHAR_NULL 0
 #define MBCHAR_NOT_FILL -1
 #define MBCHAR_ILLIEGAL -2
+#define READ_BLOCK_SIZE 65536
+// stdin reader waits if main thread doesn't take this
+#define STREAM_PENDING_BUDGET (4 * 1024 * 1024)
+#define STREAM_DEFAULT_BUDGET_MB 1024
+#define STREAM_FRAME_MS 50
+#define FILE_HASH_BLOCK 65536
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+// wait for rest of escape sequence, or it is single ESC
+#define ESCAPE_TIMEOUT_MS 50
+#define KEY_MOD_SHIFT 1
+#define KEY_MOD_ALT 2
+#define KEY_MOD_CTRL 4
+// rows compressed together
+#define COLD_BLOCK_ROWS 256
+// rows around cursor are not compressed
+#define COLD_KEEP_ROWS 1024
+#define COLD_IDLE_MS 100
+#define COLD_SLICE_NS 5000000
+// idle pass merging chunks of edited rows
+#define COMPACT_IDLE_MS 100
+#define COMPACT_SLICE_NS 5000000
+#define WATCH_DEBOUNCE_MS 200
+// rows per worker of line transform, fewer rows are done in one thread
+#define TRANSFORM_MIN_ROWS 16384
+#define TRANSFORM_MAX_WORKERS 16
+// frames are coalesced to this interval
+#define RENDER_FRAME_NS 16666667
+#define LZ_HASH_LOG 12
+#define LZ_MIN_MATCH 4
+// byte which can not be decoded is kept as U+DC00 + byte
+#define ESCAPE_BASE 0xDC00
+// input bytes per transcode, output is at most 3 times
+#define TRANSCODE_SLICE 4096
+// row metadata of file is cached for next open
+#define INDEX_CACHE_MAGIC 0x31584449
+#define INDEX_CACHE_MIN_BYTES (1024 * 1024)
+#define INDEX_CACHE_BUDGET (64ULL * 1024 * 1024)
 
 typedef unsigned char* mbchar;
 typedef unsigned long long unum;
 
-enum CommandType {NONE, INSERT, DELETE, ENTER, UP, DOWN, LEFT, RIGHT, SAVE_OVERRIDE, EXIT};
-enum ControlKeyFlag {NOT_CTRL, ALLOW_1, ALLOW_2};
+enum CommandType {NONE, INSERT, DELETE, ENTER, UP, DOWN, LEFT, RIGHT, SAVE_OVERRIDE, MEMORY_REPORT, MARK, CUT, COPY, PASTE, RECTANGLE, FOLLOW,
+    PAGE_UP, PAGE_DOWN, HOME, END, TOP, BOTTOM, WORD_LEFT, WORD_RIGHT, GOTO, ESCAPE, MACRO_RECORD, MACRO_PLAY, TRANSFORM, EXIT};
+enum TransformType {TRANSFORM_SORT, TRANSFORM_UNIQ, TRANSFORM_TRIM, TRANSFORM_KEEP, TRANSFORM_DROP, TRANSFORM_REVERSE};
+enum KeyCode {KEY_NONE, KEY_CHAR, KEY_ESCAPE, KEY_UP, KEY_DOWN, KEY_RIGHT, KEY_LEFT, KEY_HOME, KEY_END,
+    KEY_PAGE_UP, KEY_PAGE_DOWN, KEY_INSERT, KEY_DELETE};
 
 /* divided by \n, single link */
 struct line {
@@ -29,7 +85,10 @@ struct line {
 struct text {
     unum width_count;
     unum position_count;
+    unum byte_count;
 	struct line *line;
+    // line is NULL while compressed
+    struct cold_block *cold;
     struct text *prev;
     struct text *next;
 };
@@ -39,6 +98,147 @@ struct cursor {
     unum position_y;
 };
 
+/* rows top to bottom, display columns from left before right */
+struct rectangle {
+    unum top;
+    unum bottom;
+    unum left;
+    unum right;
+};
+
+/* rows compressed together, line of the rows are freed */
+struct cold_block {
+    struct cold_store *store;
+    // rows of block are in one array while compressed
+    struct text *rows;
+    unum row_count;
+    unsigned char *data;
+    unum data_size;
+    unum raw_size;
+    // decompressed, in LRU of store or NULL
+    unsigned char *raw;
+    struct cold_block *lru_prev;
+    struct cold_block *lru_next;
+    // last row read by cold_row_bytes, for sequential read
+    struct text *seek_row;
+    unum seek_offset;
+};
+
+/* compressed blocks and LRU of decompressed ones */
+struct cold_store {
+    unum block_count;
+    unum row_count;
+    unum data_bytes;
+    unum raw_bytes;
+    // decompressed bytes in LRU, and its limit
+    unum cache_bytes;
+    unum budget_bytes;
+    struct cold_block *lru_head;
+    struct cold_block *lru_tail;
+    // idle sweep for freezing, again if version or cursor is changed
+    unum sweep_y;
+    int is_sweep_done;
+    unum sweep_version;
+    unum sweep_cursor_y;
+    // rows are frozen after last malloc_trim
+    int is_trim_needed;
+};
+
+/* encoding of file, text is always utf-8 */
+enum Encoding {
+    ENCODING_AUTO,
+    ENCODING_UTF8,
+    ENCODING_SJIS,
+    ENCODING_EUCJP,
+    ENCODING_UTF16LE,
+    ENCODING_UTF16BE,
+};
+
+/* code of legacy charset to code point and back */
+struct code_table {
+    // 2 byte code is lead * 256 + trail, 1 byte code is itself
+    // 3 byte code of EUC-JP (0x8F) is 65536 + second * 256 + third
+    // 0 is not decodable
+    uint32_t *decode;
+    // code point of BMP to bytes, length is high byte, 0 is not encodable
+    uint32_t *encode;
+};
+
+/* state of file bytes <-> utf-8, chars may be divided between blocks */
+struct transcoder {
+    enum Encoding encoding;
+    int has_bom;
+    struct code_table *table;
+    // BOM bytes to skip or put
+    unsigned int bom_left;
+    unsigned char pending[4];
+    unsigned int pending_len;
+    // undecodable bytes or unencodable chars
+    unum escape_count;
+};
+
+/* one key press, decoded from escape sequence */
+struct key {
+    enum KeyCode code;
+    // KEY_MOD_*
+    unsigned int modifier;
+    // for KEY_CHAR
+    unsigned char mbchar[UTF8_MAX_BYTE];
+};
+
+/* final byte and number of CSI or SS3 to key */
+struct key_sequence {
+    unsigned char final;
+    unsigned int number;
+    enum KeyCode code;
+};
+
+static const struct key_sequence key_sequence_table[] = {
+    {'A', 0, KEY_UP},
+    {'B', 0, KEY_DOWN},
+    {'C', 0, KEY_RIGHT},
+    {'D', 0, KEY_LEFT},
+    {'H', 0, KEY_HOME},
+    {'F', 0, KEY_END},
+    {'~', 1, KEY_HOME},
+    {'~', 2, KEY_INSERT},
+    {'~', 3, KEY_DELETE},
+    {'~', 4, KEY_END},
+    {'~', 5, KEY_PAGE_UP},
+    {'~', 6, KEY_PAGE_DOWN},
+    {'~', 7, KEY_HOME},
+    {'~', 8, KEY_END},
+};
+
+/* array of rows for direct access by position_y */
+struct row_index {
+    struct text **rows;
+    unum count;
+    unum capacity;
+    // capacity - count unused slots from gap_start, moved to edited row
+    unum gap_start;
+    int is_valid;
+    // rows before are not in snapshot, 0 for document
+    unum base;
+};
+
+/* rows detached from document, last row has no \n */
+struct clipboard {
+    // cut rows, moved to document by paste
+    struct text *head;
+    struct text *tail;
+    // rows after head, slots of row index are copied from it
+    struct text **rows;
+    unum row_count;
+    // copied or pasted range of document, cloned before it is changed
+    int is_borrowed;
+    struct cursor start;
+    struct cursor end;
+    // after edit above, range is found by rest rows after end
+    int is_tail_anchor;
+    unum rest;
+};
+
 /* panel size */
 struct view_size {
     unsigned int width;
@@ -57,7 +257,199 @@ struct context_footer {
     unsigned char *message;
 };
 
-// render_start_height for scroll
+/* bytes to struct text, keep state between reads */
+struct text_decoder {
+    struct text *head;
+    struct text *current_text;
+    // tail of current_text
+    struct line *current_line;
+    unsigned char buf[UTF8_MAX_BYTE];
+    unsigned int len;
+    // bytes are from file, illegal ones are escaped
+    int is_raw;
+    unum escape_count;
+};
+
+/* rows read by stream thread, not linked to document yet */
+struct stream_batch {
+    struct text *head;
+    struct text *tail;
+    unum bytes;
+    // last row without \n, given at eof
+    int is_final;
+    struct stream_batch *next;
+};
+
+/* render thread, draws latest snapshot of context */
+struct renderer {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // not drawn yet, replaced and freed if next one comes first
+    struct context *pending;
+    // set by renderer_stop, thread ends without drawing pending
+    int is_stopped;
+};
+
+/* stdin or pipe read on background */
+struct stream {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct stream_batch *batch_head;
+    struct stream_batch *batch_tail;
+    unum pending_bytes;
+    unum read_bytes;
+    unum budget_bytes;
+    int is_eof;
+    // budget reached, rest of input is not read
+    int is_truncated;
+};
+
+/* values of stream shown in header, copied so render doesn't touch stream */
+struct stream_status {
+    int is_active;
+    unum read_bytes;
+    int is_truncated;
+};
+
+/* FNV-1a per block, block starts at 0 and phase + n * FILE_HASH_BLOCK */
+struct block_hash {
+    unum phase;
+    unum offset;
+    unum *hashes;
+    unum count;
+    unum capacity;
+};
+
+/* head of row metadata cache, index_row per row follows, mapped as it is */
+struct index_header {
+    uint32_t magic;
+    // layout check
+    uint32_t row_size;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t dev;
+    uint64_t ino;
+    // digest of head block hashes
+    uint64_t hash;
+    uint64_t row_count;
+};
+
+struct index_row {
+    uint32_t byte_count;
+    uint32_t position_count;
+    uint32_t width_count;
+};
+
+/* file on disk when read or saved, for change by other process */
+struct file_state {
+    int inotify_fd;
+    int watch;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    // aligned from head of file
+    struct block_hash head_hash;
+    // aligned from tail of file, not valid after append
+    struct block_hash tail_hash;
+    int is_tail_valid;
+    // bytes of text equal to file, offset of row can be used
+    int is_exact;
+    int is_follow;
+    int is_modified;
+    // save is requested once though file is changed
+    int is_save_confirmed;
+    // rest of mbchar appended in follow mode
+    unsigned char follow_buf[UTF8_MAX_BYTE];
+    unsigned int follow_len;
+    enum Encoding encoding;
+    int has_bom;
+    // lowest row changed since read or save, 0 if none
+    unum dirty_y;
+    // offset of dirty_y in file, rows above are same as file
+    unum dirty_offset;
+    // rows are built from index cache, widths are set
+    int is_indexed;
+    // index cache is not for file, written at exit if text is saved
+    int is_index_stale;
+    // modified by writer keeping fd open, reloaded at modify_time + WATCH_DEBOUNCE_MS
+    int is_reload_pending;
+    struct timespec modify_time;
+};
+
+/* one row of line transform, bytes without \n and NUL terminated */
+struct transform_line {
+    unsigned char *bytes;
+    unum size;
+    // original order, sort is stable by this
+    unum index;
+    unum hash;
+    double number;
+    int is_kept;
+};
+
+/* whole document or selected rows are replaced by result */
+struct transform {
+    enum TransformType type;
+    int is_reverse;
+    int is_numeric;
+    int is_fold;
+    int is_unique;
+    regex_t regex;
+    // source of regex, compiled again by each worker
+    char *pattern;
+    struct text **rows;
+    struct transform_line *lines;
+    struct transform_line *temp;
+    unum count;
+    // last row of output has no \n
+    int is_tail;
+};
+
+/* range of lines per worker thread */
+struct transform_job {
+    struct transform *transform;
+    unum begin;
+    unum end;
+    // merge of [begin, middle) and [middle, end)
+    unum middle;
+    // dedupe of lines with (hash >> 32) % part_count == part
+    unsigned int part;
+    unsigned int part_count;
+    unsigned char *buffer;
+    struct text *head;
+    struct text *tail;
+};
+
+/* idle pass over rows, restarted by edit */
+struct compaction {
+    // rows edited since last pass, rows added inside keep top and bottom_rest
+    unum top;
+    // rows after edited ones
+    unum bottom_rest;
+    // next row of pass, 0 if pass is not started
+    unum y;
+    int is_done;
+    unum row_count;
+    // over compacted rows of this pass, for fill ratio
+    unum payload_bytes;
+    unum line_count_before;
+    unum line_count_after;
+};
+
+/* recorded commands, command_value is own copy */
+struct macro {
+    struct command *commands;
+    unsigned int count;
+    unsigned int capacity;
+    int is_recording;
+};
+
+// render_start_height and render_start_width for scroll
 struct context {
 	char *filename;
 	struct text *text;
@@ -67,6 +459,54 @@ struct context {
     unsigned int body_height;
     unsigned int footer_height;
     unsigned int render_start_height;
+    // columns hidden at left of view
+    unum render_start_width;
+    // count up per change of text, for render
+    unum version;
+    struct row_index row_index;
+    // selection is between mark and cursor
+    struct cursor mark;
+    int mark_active;
+    struct clipboard clipboard;
+    // multi cursor, sorted, includes cursor. empty if single
+    struct cursor *cursors;
+    unsigned int cursor_count;
+    unsigned int cursor_capacity;
+    // selected by rectangle, none if right is not after left
+    struct rectangle rectangle;
+    // not NULL while reading stdin
+    struct stream *stream;
+    // copy of stream at render_setting
+    struct stream_status stream_status;
+    struct file_state file_state;
+    // NULL if rows are not compressed
+    struct cold_store *cold_store;
+    struct compaction compaction;
+    struct macro macro;
+    // NULL until loop starts, render is done in place
+    struct renderer *renderer;
+    // shown in footer instead of cwd if not empty
+    unsigned char message[256];
+};
+
+/* memory usage of struct text and struct line */
+struct memory_report {
+    unum text_count;
+    unum line_count;
+    unum empty_line_count;
+    // bytes of string actually used
+    unum payload_bytes;
+    // BUFFER_SIZE * line_count
+    unum capacity_bytes;
+    // sizeof struct * count
+    unum struct_bytes;
+    // struct_bytes + estimated malloc header and alignment
+    unum heap_bytes;
+    // compressed rows, not in line_count
+    unum cold_row_count;
+    unum cold_block_count;
+    unum cold_raw_bytes;
+    unum cold_data_bytes;
 };
 
 struct command {
@@ -84,11 +524,76 @@ void text_free(struct text* text);
 void text_combine_next(struct text* current);
 void text_divide(struct text *current_text, struct line *current, unsigned int byte, mbchar divide_char);
 struct text *getTextFromPositionY(struct text *head, unum position_y);
+void row_index_build(struct context *context);
+void row_index_invalidate(struct context *context);
+void row_index_insert(struct context *context, unum position_y, struct text *text);
+void row_index_remove(struct context *context, unum position_y);
+void row_index_insert_rows(struct context *context, unum position_y, struct text *head, struct text *tail);
+void row_index_insert_slots(struct context *context, unum position_y, struct text **rows, unum count);
+int row_index_remove_rows(struct context *context, unum position_y, unum count, struct text **out);
+struct text **row_index_slot(const struct row_index *index, unum i);
+void row_index_gap_move(struct row_index *index, unum gap_start);
+void row_index_reserve(struct row_index *index, unum count);
+struct text *row_index_at(const struct row_index *index, unum position_y);
+struct text *context_text_at(struct context *context, unum position_y);
+unum context_row_count(struct context *context);
+int is_word_char(mbchar mbchar);
+unum text_word_position(struct text *text, unum position_x, int direction);
 struct line *getLineAndByteFromPositionX(struct line *head, unum position_x, unsigned int *byte);
 mbchar get_tail(struct line *line);
 void insert_mbchar(struct line *line, unsigned int byte, mbchar c);
 void delete_mbchar(struct line *line, unsigned int byte);
+struct line *line_split(struct line *line, unsigned int byte);
+struct line *line_cut(struct line **head, unum position_x);
+void line_append(struct line **head, struct line *chain);
+struct line *line_clone(struct line *head);
+void line_list_free(struct line *head);
+void text_drop_empty_line(struct text *text);
+void text_list_free(struct text *head);
 void calculation_width(struct text *head, unsigned int max_width);
+unum lz_bound(unum size);
+unum lz_compress(const unsigned char *src, unum size, unsigned char *dst);
+int lz_decompress(const unsigned char *src, unum size, unsigned char *dst, unum raw_size);
+struct cold_store *cold_store_malloc(unum budget_bytes);
+unsigned char *cold_block_raw(struct cold_block *block);
+void cold_lru_remove(struct cold_block *block);
+void text_relink(struct context *context, struct text *first, struct text *last);
+struct cold_block *cold_block_freeze(struct context *context, struct text *first, unum top, unum row_count);
+void cold_block_thaw(struct context *context, struct cold_block *block, unum top);
+struct text *text_thaw(struct context *context, struct text *text, unum position_y);
+void context_thaw_rows(struct context *context, unum top, unum bottom);
+unsigned char *cold_row_bytes(struct text *text);
+int cold_sweep(struct context *context);
+int text_compact(struct text *text);
+int compaction_sweep(struct context *context);
+void compaction_mark(struct context *context, unum top, unum bottom);
+void calculation_text_width(struct text *text);
+int cursor_compare(struct cursor a, struct cursor b);
+int region_get(const struct context *context, struct cursor *start, struct cursor *end);
+struct clipboard region_cut(struct context *context, struct cursor start, struct cursor end);
+unum text_copy_bytes(struct text *text, unum from_x, unum to_x, unsigned char *out);
+struct line *line_from_bytes(const unsigned char *bytes, unum size);
+struct clipboard region_clone(struct context *context, struct cursor start, struct cursor end);
+void clipboard_range(struct context *context, struct cursor *start, struct cursor *end);
+void clipboard_before_edit(struct context *context, unum top, unum bottom);
+struct cursor clipboard_paste(struct context *context, struct cursor at);
+void clipboard_free(struct clipboard *clipboard);
+unum text_max_position_x(struct text *text);
+int cursor_compare_qsort(const void *a, const void *b);
+void cursor_set_add(struct context *context, struct cursor cursor);
+void cursor_set_normalize(struct context *context);
+void cursor_set_clear(struct context *context);
+int cursor_set_contains(const struct context *context, struct cursor cursor);
+unum text_column_at(struct text *text, unum position_x);
+unum text_position_at_column(struct text *text, unum column);
+void rectangle_cursors(struct context *context, struct cursor start, struct cursor end);
+struct clipboard rectangle_copy(struct context *context);
+void rectangle_delete(struct context *context);
+void command_perform_multi(struct command command, struct context *context);
+unum heap_block_size(unum size);
+struct memory_report memory_report_collect(struct text *head);
+void memory_report_format(struct memory_report report, unsigned char *out, unsigned int size);
+void memory_report_dump(FILE *fp, struct memory_report report);
 mbchar mbchar_malloc(void);
 void mbchar_free(mbchar mbchar);
 mbchar mbcher_zero_clear(mbchar mbchar);
@@ -97,22 +602,97 @@ unsigned int safed_mbchar_size(mbchar mbchar);
 int is_line_break(mbchar mbchar);
 unsigned int mbchar_width(mbchar mbchar) ;
 unum string_width(unsigned char *message) ;
-struct text *file_read(const char *filename);
+void text_decoder_init(struct text_decoder *decoder);
+void text_decoder_add(struct text_decoder *decoder, mbchar mc);
+int is_raw_illegal(mbchar mbchar, int size);
+void text_decoder_feed(struct text_decoder *decoder, const unsigned char *bytes, size_t size);
+void text_decoder_finish(struct text_decoder *decoder, struct transcoder *tc);
+void text_decoder_feed_file(struct text_decoder *decoder, struct transcoder *tc, const unsigned char *bytes, size_t size);
+void escape_byte(unsigned char byte, unsigned char *out);
+int escape_value(const unsigned char *mbchar);
+unsigned int utf8_put(uint32_t code, unsigned char *out);
+uint32_t utf8_get(const unsigned char *mbchar, unsigned int size);
+const char *encoding_name(enum Encoding encoding);
+enum Encoding encoding_from_name(const char *name);
+enum Encoding encoding_detect(const unsigned char *bytes, size_t size, int *has_bom);
+unsigned int code_table_bytes(enum Encoding encoding, uint32_t code, unsigned char *bytes);
+struct code_table *code_table_get(enum Encoding encoding);
+void transcoder_init(struct transcoder *tc, enum Encoding encoding, int has_bom);
+size_t transcoder_decode_one(struct transcoder *tc, const unsigned char *bytes, size_t size, unsigned char *out, size_t *out_size);
+size_t transcoder_decode(struct transcoder *tc, const unsigned char *in, size_t size, unsigned char *out);
+size_t transcoder_flush(struct transcoder *tc, unsigned char *out);
+size_t transcoder_encode(struct transcoder *tc, const unsigned char *in, size_t size, unsigned char *out);
+void block_hash_init(struct block_hash *hash, unum phase);
+void block_hash_feed(struct block_hash *hash, const unsigned char *bytes, size_t size);
+void block_hash_free(struct block_hash *hash);
+unum block_hash_truncate(struct block_hash *hash, unum offset);
+unum block_hash_digest(struct block_hash *hash);
+struct text *file_read(const char *filename, struct file_state *state);
+struct text *file_read_indexed(FILE *fp, struct index_header *header, struct file_state *state);
+void index_row_apply(struct text *text, struct index_row *row);
+char *index_cache_path(const char *filename, int is_mkdir);
+struct index_header *index_cache_map(const char *filename, struct stat *st, size_t *map_size);
+void index_cache_store(const char *filename, struct text *head, struct file_state *state);
+int index_cache_update(const char *filename, struct text *from, unum from_y, unum row_count, struct file_state *state,
+    off_t old_size, struct timespec old_mtime);
+void index_cache_evict(const char *dirname, unum budget_bytes);
 void context_read_file(struct context *context, char *filename);
+void file_state_watch(struct context *context);
+int file_state_is_changed(struct context *context, struct stat *st);
+int file_watch_handle(struct context *context);
+int file_follow_append(struct context *context, struct stat *st);
+int file_reload_changed(struct context *context);
+int file_watch_pending_ms(struct context *context);
+unum text_total_bytes(struct text *head);
+struct stream *stream_start(int fd, unum budget_bytes);
+void *stream_reader(void *arg);
+void stream_push(struct stream *stream, struct stream_batch *batch);
+int stream_ingest(struct context *context);
+void context_read_stream(struct context *context, unum budget_bytes);
+int keyboard_poll(int timeout_ms, int watch_fd);
+void wait_input(struct context *context);
 void context_write_override_file(struct context *context);
-void file_write(const char* filepath, struct text *head);
+unum file_write_bytes(FILE *fp, struct file_state *state, struct transcoder *tc, const unsigned char *bytes, size_t size, unsigned char *out);
+unum file_write(const char* filepath, struct text *head, struct file_state *state);
+long long file_write_tail(const char* filepath, struct text *text, struct file_state *state);
+void file_state_mark_dirty(struct context *context, unum position_y);
+void term_raw(int bool);
 unsigned char get_single_byte_key(void);
 void color_cursor(int bool);
-mbchar keyboard_scan(mbchar *out);
-struct command command_parse(mbchar key);
+int key_read_byte(int timeout_ms);
+void keyboard_scan(struct key *key);
+struct command command_parse(struct key *key);
+int prompt_read(struct context *context, const char *label, unsigned char *out, unsigned int size);
 void vailidate_cursor_position(struct context *context);
 void command_perform(struct command command, struct context *context);
+void macro_add(struct macro *macro, struct command command);
+void macro_clear(struct macro *macro);
+unum macro_replay(struct context *context, unsigned char *times_text);
+int transform_parse(struct transform *transform, unsigned char *text, unsigned char *error, unsigned int error_size);
+int transform_compare_key(const struct transform_line *x, const struct transform_line *y, struct transform *transform);
+double transform_number(unsigned char *bytes);
+int transform_compare(const void *a, const void *b, void *arg);
+unsigned int transform_workers(unum count);
+void transform_run(struct transform *transform, unum count, void *(*work)(void *), struct transform_job *jobs, unsigned int worker_count);
+void *transform_extract(void *arg);
+void *transform_unique(void *arg);
+void *transform_sort(void *arg);
+void *transform_merge(void *arg);
+void *transform_build(void *arg);
+void context_transform(struct context *context, unsigned char *text);
 void render_header(struct context_header context);
 void render_footer(struct context_footer context);
 void vailidate_render_position(struct context *context);
 void render_setting(struct context *context);
-void render(struct context context);
-void render_body(struct context context);
+void render(const struct context *context);
+void render_frame(const struct context *context);
+struct renderer *renderer_start(void);
+void renderer_stop(struct renderer *renderer);
+void *render_thread(void *arg);
+struct context *snapshot_make(const struct context *context);
+void snapshot_free(struct context *snapshot);
+void render_body(const struct context *context);
+void render_row(const struct context *context, struct text *text, unum pos_y);
 unsigned int print_one_mbchar(unsigned char *str);
 void trim_print(unsigned char *message, unsigned int max_width);
 void debug_print_text(struct context context);
@@ -120,28 +700,125 @@ struct view_size console_size(void);
 void backcolor_white(int bool);
 
 int main(int argc, char *argv[]) {
-	if (argc != 2) {
+    if (argc == 3 && strcmp(argv[1], "--memory-report") == 0) {
+        // headless, machine readable
+        struct text *head = file_read(argv[2], NULL);
+        calculation_width(head, 0);
+        memory_report_dump(stdout, memory_report_collect(head));
+        exit(EXIT_SUCCESS);
+    }
+    unum stream_budget = (unum)STREAM_DEFAULT_BUDGET_MB * 1024 * 1024;
+    int is_follow = 0;
+    unum cold_budget = 0;
+    enum Encoding encoding = ENCODING_AUTO;
+    while (argc > 2) {
+        if (argc > 3 && strcmp(argv[1], "--stream-budget") == 0) {
+            // MB of stdin to keep, input after it is dropped
+            stream_budget = strtoull(argv[2], NULL, 10) * 1024 * 1024;
+            argv += 2;
+            argc -= 2;
+        } else if (argc > 3 && strcmp(argv[1], "--cold-budget") == 0) {
+            // MB of decompressed cold rows to keep, rows far from cursor are compressed
+            cold_budget = strtoull(argv[2], NULL, 10) * 1024 * 1024;
+            argv += 2;
+            argc -= 2;
+        } else if (argc > 3 && strcmp(argv[1], "--encoding") == 0) {
+            // detection is skipped
+            encoding = encoding_from_name(argv[2]);
+            if (encoding == ENCODING_AUTO) {
+                fprintf(stderr, "unknown encoding %s\n", argv[2]);
+                exit(EXIT_FAILURE);
+            }
+            argv += 2;
+            argc -= 2;
+        } else if (strcmp(argv[1], "--follow") == 0) {
+            is_follow = 1;
+            argv++;
+            argc--;
+        } else {
+            break;
+        }
+    }
+    if (argc != 2) {
         fprintf(stderr, "illegal args\n");
         exit(EXIT_FAILURE);
 	} else {
         struct context context;
-        context_read_file(&context, argv[1]);
+        context.stream = NULL;
+        context.stream_status.is_active = 0;
+        context.file_state.encoding = encoding;
+        context.file_state.has_bom = 0;
+        if (strcmp(argv[1], "-") == 0)
+            context_read_stream(&context, stream_budget);
+        else
+            context_read_file(&context, argv[1]);
+        context.file_state.is_follow = is_follow;
+        context.cold_store = cold_budget ? cold_store_malloc(cold_budget) : NULL;
+        context.compaction.y = 0;
+        context.compaction.is_done = 1;
+        context.macro.commands = NULL;
+        context.macro.count = 0;
+        context.macro.capacity = 0;
+        context.macro.is_recording = 0;
+        // byte by byte, for poll
+        setvbuf(stdin, NULL, _IONBF, 0);
+        context.message[0] = '\0';
+        context.mark_active = 0;
+        context.clipboard.head = NULL;
+        context.clipboard.tail = NULL;
+        context.clipboard.rows = NULL;
+        context.clipboard.is_borrowed = 0;
+        context.cursors = NULL;
+        context.cursor_count = 0;
+        context.cursor_capacity = 0;
+        context.rectangle.left = 0;
+        context.rectangle.right = 0;
         context.cursor.position_x = 1;
         context.cursor.position_y = 1;
         context.render_start_height = 0;
-        mbchar key = mbchar_malloc();
+        context.render_start_width = 0;
+        context.version = 0;
+        context.row_index.rows = NULL;
+        context.row_index.count = 0;
+        context.row_index.capacity = 0;
+        context.row_index.gap_start = 0;
+        context.row_index.is_valid = 0;
+        context.row_index.base = 0;
+        context.renderer = NULL;
+        struct key key;
+        unsigned char prompt[64];
         struct command cmd_none;
         cmd_none.command_key = NONE;
         command_perform(cmd_none, &context);
+        // terminal is written only by render thread from here
+        fflush(stdout);
+        context.renderer = renderer_start();
         while (1) {
             render_setting(&context);
-            render(context);
+            render(&context);
+            wait_input(&context);
             keyboard_scan(&key);
-            struct command cmd = command_parse(key);
+            struct command cmd = command_parse(&key);
+            if (cmd.command_key == GOTO) {
+                if (!prompt_read(&context, "goto line or %: ", prompt, sizeof(prompt)))
+                    continue;
+                cmd.command_value = prompt;
+            }
+            if (cmd.command_key == TRANSFORM) {
+                if (!prompt_read(&context, "sort [-rniu], uniq, trim, keep RE, drop RE, reverse: ", prompt, sizeof(prompt)))
+                    continue;
+                cmd.command_value = prompt;
+            }
+            if (cmd.command_key == MACRO_PLAY && !context.macro.is_recording) {
+                if (!prompt_read(&context, "replay times, empty to end of file: ", prompt, sizeof(prompt)))
+                    continue;
+                cmd.command_value = prompt;
+            }
+            if (context.macro.is_recording)
+                macro_add(&context.macro, cmd);
             command_perform(cmd, &context);
             // render(context);
         }
-        mbchar_free(key);
         exit(EXIT_SUCCESS);
     }
 }
@@ -196,6 +873,7 @@ struct text *text_insert(struct text *current) {
         }
         current->next = new_text;
     }
+    new_text->cold = NULL;
     new_text->line = (struct line *)malloc(sizeof(struct line));
     new_text->line->next = NULL;
     new_text->line->byte_count = 0;
@@ -211,6 +889,7 @@ struct text *text_malloc(void) {
     struct text *head = (struct text *)malloc(sizeof(struct text));
     head->prev = NULL;
     head->next = NULL;
+    head->cold = NULL;
     head->line = (struct line *)malloc(sizeof(struct line));
     head->line->next = NULL;
     head->line->byte_count = 0;
@@ -225,7 +904,8 @@ void text_free(struct text* text) {
     struct text *prev = text->prev;
     struct text *next = text->next;
     prev->next = next;
-    next->prev = prev;
+    if (next)
+        next->prev = prev;
     free(text);
 }
 
@@ -235,10 +915,15 @@ void text_free(struct text* text) {
  */
 void text_combine_next(struct text* current) {
     struct line *tail = current->line;
-    while (tail->next)
-        tail = tail->next;
+    struct line *last = current->line;
+    // empty chunk may follow \n
+    while (last) {
+        if (last->byte_count)
+            tail = last;
+        last = last->next;
+    }
     delete_mbchar(tail, tail->byte_count - safed_mbchar_size(get_tail(tail)));
-    tail->next = current->next->line;
+    line_append(&current->line, current->next->line);
     text_free(current->next);
 }
 
@@ -276,6 +961,219 @@ struct text *getTextFromPositionY(struct text *head, unum position_y) {
 	return NULL;
 }
 
+/*
+ * row_index_build
+ * make array of rows if invalidated
+ */
+void row_index_build(struct context *context) {
+    struct row_index *index = &context->row_index;
+    if (index->is_valid)
+        return;
+    index->count = 0;
+    struct text *current = context->text;
+    while (current) {
+        if (index->count == index->capacity) {
+            index->capacity = index->capacity ? index->capacity * 2 : 1024;
+            index->rows = (struct text **)realloc(index->rows, sizeof(struct text *) * index->capacity);
+        }
+        index->rows[index->count++] = current;
+        current = current->next;
+    }
+    index->gap_start = index->count;
+    index->is_valid = 1;
+}
+
+/*
+ * row_index_invalidate
+ * rows are linked or freed, build again at next access
+ */
+void row_index_invalidate(struct context *context) {
+    context->row_index.is_valid = 0;
+}
+
+/*
+ * row_index_slot
+ * place of i th row, 0 origin, gap is skipped
+ */
+struct text **row_index_slot(const struct row_index *index, unum i) {
+    if (i < index->gap_start)
+        return &index->rows[i];
+    return &index->rows[i + index->capacity - index->count];
+}
+
+/*
+ * row_index_gap_move
+ * gap is put before i th row, cost is distance from last edit
+ */
+void row_index_gap_move(struct row_index *index, unum gap_start) {
+    unum gap = index->capacity - index->count;
+    if (gap_start < index->gap_start)
+        memmove(&index->rows[gap_start + gap], &index->rows[gap_start], sizeof(struct text *) * (index->gap_start - gap_start));
+    else if (gap_start > index->gap_start)
+        memmove(&index->rows[index->gap_start], &index->rows[index->gap_start + gap], sizeof(struct text *) * (gap_start - index->gap_start));
+    index->gap_start = gap_start;
+}
+
+/*
+ * row_index_reserve
+ * capacity for count rows, gap is at tail after realloc
+ */
+void row_index_reserve(struct row_index *index, unum count) {
+    if (count <= index->capacity)
+        return;
+    row_index_gap_move(index, index->count);
+    while (count > index->capacity)
+        index->capacity *= 2;
+    index->rows = (struct text **)realloc(index->rows, sizeof(struct text *) * index->capacity);
+}
+
+/*
+ * row_index_insert
+ * text is new row of position_y, for enter
+ */
+void row_index_insert(struct context *context, unum position_y, struct text *text) {
+    struct row_index *index = &context->row_index;
+    if (!index->is_valid)
+        return;
+    row_index_reserve(index, index->count + 1);
+    row_index_gap_move(index, position_y - 1);
+    index->rows[index->gap_start++] = text;
+    index->count++;
+}
+
+/*
+ * row_index_remove
+ * row of position_y is freed, for combine
+ */
+void row_index_remove(struct context *context, unum position_y) {
+    struct row_index *index = &context->row_index;
+    if (!index->is_valid)
+        return;
+    row_index_gap_move(index, position_y);
+    index->gap_start--;
+    index->count--;
+}
+
+/*
+ * row_index_insert_rows
+ * linked rows from head to tail are new rows from position_y, for stream
+ */
+void row_index_insert_rows(struct context *context, unum position_y, struct text *head, struct text *tail) {
+    struct row_index *index = &context->row_index;
+    if (!index->is_valid)
+        return;
+    unum count = 1;
+    struct text *current = head;
+    while (current != tail) {
+        current = current->next;
+        count++;
+    }
+    row_index_reserve(index, index->count + count);
+    row_index_gap_move(index, position_y - 1);
+    for (current = head; count-- > 0; current = current->next) {
+        index->rows[index->gap_start++] = current;
+        index->count++;
+    }
+}
+
+/*
+ * row_index_insert_slots
+ * rows of array are new rows from position_y, for paste
+ */
+void row_index_insert_slots(struct context *context, unum position_y, struct text **rows, unum count) {
+    struct row_index *index = &context->row_index;
+    if (!index->is_valid)
+        return;
+    row_index_reserve(index, index->count + count);
+    row_index_gap_move(index, position_y - 1);
+    memcpy(&index->rows[index->gap_start], rows, sizeof(struct text *) * count);
+    index->gap_start += count;
+    index->count += count;
+}
+
+/*
+ * row_index_remove_rows
+ * count rows from position_y are unlinked, for cut
+ * return 1 if slots are copied to out
+ */
+int row_index_remove_rows(struct context *context, unum position_y, unum count, struct text **out) {
+    struct row_index *index = &context->row_index;
+    if (!index->is_valid)
+        return 0;
+    row_index_gap_move(index, position_y - 1 + count);
+    index->gap_start -= count;
+    index->count -= count;
+    memcpy(out, &index->rows[index->gap_start], sizeof(struct text *) * count);
+    return 1;
+}
+
+/*
+ * row_index_at
+ * row of position_y in built index, NULL if out of index
+ */
+struct text *row_index_at(const struct row_index *index, unum position_y) {
+    if (position_y <= index->base || position_y > index->base + index->count)
+        return NULL;
+    return *row_index_slot(index, position_y - 1 - index->base);
+}
+
+/*
+ * context_text_at
+ * getTextFromPositionY by index
+ */
+struct text *context_text_at(struct context *context, unum position_y) {
+    row_index_build(context);
+    return row_index_at(&context->row_index, position_y);
+}
+
+/*
+ * context_row_count
+ * number of rows
+ */
+unum context_row_count(struct context *context) {
+    row_index_build(context);
+    return context->row_index.count;
+}
+
+/*
+ * is_word_char
+ * alphabet, number, _ and multi byte
+ */
+int is_word_char(mbchar mbchar) {
+    unsigned char c = mbchar[0];
+    return c >= 0x80 || c == '_' || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/*
+ * text_word_position
+ * head of next word (direction 1) or previous word (direction -1)
+ * return 0 if no word in the row
+ */
+unum text_word_position(struct text *text, unum position_x, int direction) {
+    unum target = 0;
+    unum pos = 1;
+    int prev_is_word = 0;
+    struct line *current_line = text->line;
+    while (current_line) {
+        unsigned int i = 0;
+        while (i < current_line->byte_count) {
+            int is_word = is_word_char(&current_line->string[i]) && !is_line_break(&current_line->string[i]);
+            if (is_word && !prev_is_word) {
+                // head of word
+                if (direction > 0 && pos > position_x)
+                    return pos;
+                if (direction < 0 && pos < position_x)
+                    target = pos;
+            }
+            prev_is_word = is_word;
+            i += safed_mbchar_size(&current_line->string[i]);
+            pos++;
+        }
+        current_line = current_line->next;
+    }
+    return target;
+}
+
 /*
  * getLineAndByteFromPositionX
  * head maybe start
@@ -283,9 +1181,11 @@ struct text *getTextFromPositionY(struct text *head, unum position_y) {
 struct line *getLineAndByteFromPositionX(struct line *head, unum position_x, unsigned int *byte) {
 	unum i = position_x;
 	struct line *current_line = head;
+    struct line *last_line = head;
     while (current_line && i > current_line->position_count) {
         // before update
         i -= current_line->position_count;
+        last_line = current_line;
         current_line = current_line->next;
     }
     if (current_line) {
@@ -294,6 +1194,11 @@ struct line *getLineAndByteFromPositionX(struct line *head, unum position_x, uns
             *byte += safed_mbchar_size(&current_line->string[*byte]);
         return current_line;
     }
+    if (i == 1 && last_line) {
+        // just after tail, for last row
+        *byte = last_line->byte_count;
+        return last_line;
+    }
     return NULL;
 }
 
@@ -354,280 +1259,3089 @@ void delete_mbchar(struct line *line, unsigned int byte) {
 }
 
 /*
- * calculation_width
- * calc view height
- * total_width is per line
+ * line_split
+ * move string from byte to new line next to arg line
+ * position_count of both is kept
+ * return new line
  */
-void calculation_width(struct text *head, unsigned int max_width) {
-    static unsigned int prev_width = 0;
-    prev_width = max_width;
-	struct text *current_text = head;
-	struct line *current_line = head->line;
-    
-    unsigned int i;
-    while (current_text) {
-        unum total_width = 0;
-        unum total_position = 0;
-        current_line = current_text->line;
-        while (current_line) {
-            int line_position = 0;
-            i = 0;
-            while (i < current_line->byte_count) {
-                int w = mbchar_width(&current_line->string[i]);
-                total_width += w;
-                line_position++;
-                i += safed_mbchar_size(&current_line->string[i]);
-            }
-            current_line->position_count = line_position;
-            total_position += line_position;
-            current_line = current_line->next;
-        }
-        current_text->width_count = total_width;
-        current_text->position_count = total_position;
-        current_text = current_text->next;
+struct line *line_split(struct line *line, unsigned int byte) {
+    struct line *new_line = line_insert(line);
+    unsigned int position = 0;
+    unsigned int i = 0;
+    while (i < byte) {
+        i += safed_mbchar_size(&line->string[i]);
+        position++;
     }
+    memcpy(new_line->string, &line->string[byte], line->byte_count - byte);
+    new_line->byte_count = line->byte_count - byte;
+    new_line->position_count = line->position_count - position;
+    line->byte_count = byte;
+    line->position_count = position;
+    return new_line;
 }
 
 /*
- * mbchar_malloc
- * malloc size of multi byte
- * return memory
+ * line_cut
+ * detach from position_x to tail, *head is NULL if all is detached
+ * return detached list, NULL if nothing
  */
-mbchar mbchar_malloc(void) {
-    return (mbchar)malloc(sizeof(unsigned char) * UTF8_MAX_BYTE);
+struct line *line_cut(struct line **head, unum position_x) {
+    unum i = position_x;
+    struct line *prev = NULL;
+    struct line *current = *head;
+    while (current && i > current->position_count) {
+        i -= current->position_count;
+        prev = current;
+        current = current->next;
+    }
+    if (!current)
+        return NULL;
+    if (i > 1) {
+        unsigned int byte = 0;
+        while (i-- > 1)
+            byte += safed_mbchar_size(&current->string[byte]);
+        prev = current;
+        current = line_split(current, byte);
+    }
+    if (prev)
+        prev->next = NULL;
+    else
+        *head = NULL;
+    return current;
 }
 
 /*
- * mbchar_free
- * free multi byte
+ * line_append
+ * join chain to tail of *head
  */
-void mbchar_free(mbchar mbchar) {
-    free(mbchar);
-    mbchar = NULL;
+void line_append(struct line **head, struct line *chain) {
+    if (!*head) {
+        *head = chain;
+        return;
+    }
+    struct line *tail = *head;
+    while (tail->next)
+        tail = tail->next;
+    tail->next = chain;
 }
 
 /*
- * mbchar_zero_clear
- * fill mbchar with \0
+ * line_clone
+ * copy per line, not per char
  */
-mbchar mbcher_zero_clear(mbchar mbchar) {
-    unsigned int i = UTF8_MAX_BYTE;
-    while(i--)
-        mbchar[i] = '\0';
-    return mbchar;
+struct line *line_clone(struct line *head) {
+    struct line *clone_head = NULL;
+    struct line *clone_tail = NULL;
+    while (head) {
+        struct line *new_line = (struct line *)malloc(sizeof(struct line));
+        memcpy(new_line, head, sizeof(struct line));
+        new_line->next = NULL;
+        if (clone_tail)
+            clone_tail->next = new_line;
+        else
+            clone_head = new_line;
+        clone_tail = new_line;
+        head = head->next;
+    }
+    return clone_head;
 }
 
 /*
- * mbchar_size
- * return size of multi byte char
+ * line_list_free
+ * free all of list
  */
-int mbchar_size(mbchar mbchar, unsigned int len) {
-    if (len < 1 || UTF8_MAX_BYTE < len)
-        return MBCHAR_ILLIEGAL;
-    if (len == 1 && mbchar[0] == 0x00)
-        return MBCHAR_NULL;
-    // length of mbchar is determined by number of head 1 in byte
-    unsigned int head_one_bits = 0;
-    while (head_one_bits < 8) {
-        if ((mbchar[0] >> (7 - head_one_bits) & 0x01) == 1)
-            head_one_bits++;
-        else
-            break;
-    }
-    if (head_one_bits == 0)
-        // if head 1 bit is 0, that is 1 byte char
-        // for compare to len
-        head_one_bits++;
-    if (head_one_bits > len)
-        return MBCHAR_NOT_FILL;
-    if (head_one_bits == len) {
-        switch(len) {
-        case 1:
-            return len;
-            break;
-        case 2:
-            if (mbchar[0] & 0x1e)
-                return len;
-            break;
-        case 3:
-            if (mbchar[0] & 0x0f || mbchar[1] & 0x20)
-                return len;
-            break;
-        case 4:
-            if (mbchar[0] & 0x07 || mbchar[1] & 0x30)
-                return len;
-            break;
-        case 5:
-            if (mbchar[0] & 0x03 || mbchar[1] & 0x38)
-                return len;
-            break;
-        case 6:
-            if (mbchar[0] & 0x01 || mbchar[1] & 0x3c)
-                return len;
-            break;
-        }
+void line_list_free(struct line *head) {
+    while (head) {
+        struct line *next = head->next;
+        free(head);
+        head = next;
     }
-    return MBCHAR_ILLIEGAL;
 }
 
 /*
- * safed_mbchar_size
- * uses only head_one_bits
- * return size of multi byte char
+ * text_drop_empty_line
+ * free empty lines left by splice, keep one at least
  */
-unsigned int safed_mbchar_size(mbchar mbchar) {
-    unsigned int head_one_bits = 0;
-    while (head_one_bits < 8) {
-        if ((mbchar[0] >> (7 - head_one_bits) & 0x01) == 1)
-            head_one_bits++;
-        else
-            break;
+void text_drop_empty_line(struct text *text) {
+    struct line **current = &text->line;
+    while (*current) {
+        if ((*current)->byte_count == 0 && (*current != text->line || (*current)->next)) {
+            struct line *empty = *current;
+            *current = empty->next;
+            free(empty);
+        } else {
+            current = &(*current)->next;
+        }
+    }
+    if (!text->line) {
+        text->line = (struct line *)malloc(sizeof(struct line));
+        text->line->next = NULL;
+        text->line->byte_count = 0;
+        text->line->position_count = 0;
     }
-    if (head_one_bits == 0)
-        head_one_bits++;
-    return head_one_bits;
 }
 
 /*
- * is_line_break
- * return 1 if char is \n
+ * text_list_free
+ * free rows not linked to document
  */
-int is_line_break(mbchar mbchar) {
-    if (mbchar[0] == '\n')
-        return 1;
-    return 0;
+void text_list_free(struct text *head) {
+    while (head) {
+        struct text *next = head->next;
+        line_list_free(head->line);
+        free(head);
+        head = next;
+    }
+}
+
+/*
+ * calculation_width
+ * calc view height
+ * total_width is per line
+ */
+void calculation_width(struct text *head, unsigned int max_width) {
+    static unsigned int prev_width = 0;
+    prev_width = max_width;
+	struct text *current_text = head;
+    while (current_text) {
+        calculation_text_width(current_text);
+        current_text = current_text->next;
+    }
+}
+
+/*
+ * calculation_text_width
+ * calc only one row, for edited row
+ */
+void calculation_text_width(struct text *text) {
+    // counts of compressed row are kept
+    if (text->cold)
+        return;
+    unum total_width = 0;
+    unum total_position = 0;
+    unum total_byte = 0;
+    struct line *current_line = text->line;
+    unsigned int i;
+    while (current_line) {
+        int line_position = 0;
+        i = 0;
+        while (i < current_line->byte_count) {
+            int w = mbchar_width(&current_line->string[i]);
+            total_width += w;
+            line_position++;
+            i += safed_mbchar_size(&current_line->string[i]);
+        }
+        current_line->position_count = line_position;
+        total_position += line_position;
+        total_byte += current_line->byte_count;
+        current_line = current_line->next;
+    }
+    text->width_count = total_width;
+    text->position_count = total_position;
+    text->byte_count = total_byte;
+}
+
+/*
+ * lz_bound
+ * max size of lz_compress output
+ */
+unum lz_bound(unum size) {
+    return size + size / 255 + 16;
+}
+
+/*
+ * lz_compress
+ * LZ77, token is literal length (high 4 bit) and match length - 4 (low 4 bit),
+ * 15 continues with 255 bytes, match has 2 byte offset
+ * return compressed size
+ */
+unum lz_compress(const unsigned char *src, unum size, unsigned char *dst) {
+    unsigned int table[1 << LZ_HASH_LOG];
+    memset(table, 0, sizeof(table));
+    unum ip = 0;
+    unum anchor = 0;
+    unum op = 0;
+    while (ip + LZ_MIN_MATCH <= size) {
+        unsigned int sequence;
+        memcpy(&sequence, &src[ip], 4);
+        unsigned int hash = (sequence * 2654435761u) >> (32 - LZ_HASH_LOG);
+        unum ref = table[hash];
+        // position + 1, 0 is empty
+        table[hash] = ip + 1;
+        if (ref == 0 || ip - (ref - 1) > 65535 || memcmp(&src[ref - 1], &src[ip], 4) != 0) {
+            ip++;
+            continue;
+        }
+        ref--;
+        unum match = LZ_MIN_MATCH;
+        while (ip + match < size && src[ref + match] == src[ip + match])
+            match++;
+        unum literal = ip - anchor;
+        unsigned char *token = &dst[op++];
+        *token = (literal >= 15 ? 15 : literal) << 4;
+        if (literal >= 15) {
+            unum rest = literal - 15;
+            for (; rest >= 255; rest -= 255)
+                dst[op++] = 255;
+            dst[op++] = rest;
+        }
+        memcpy(&dst[op], &src[anchor], literal);
+        op += literal;
+        dst[op++] = (ip - ref) & 0xFF;
+        dst[op++] = (ip - ref) >> 8;
+        unum length = match - LZ_MIN_MATCH;
+        *token |= length >= 15 ? 15 : length;
+        if (length >= 15) {
+            unum rest = length - 15;
+            for (; rest >= 255; rest -= 255)
+                dst[op++] = 255;
+            dst[op++] = rest;
+        }
+        ip += match;
+        anchor = ip;
+    }
+    // last literals without match
+    unum literal = size - anchor;
+    unsigned char *token = &dst[op++];
+    *token = (literal >= 15 ? 15 : literal) << 4;
+    if (literal >= 15) {
+        unum rest = literal - 15;
+        for (; rest >= 255; rest -= 255)
+            dst[op++] = 255;
+        dst[op++] = rest;
+    }
+    memcpy(&dst[op], &src[anchor], literal);
+    op += literal;
+    return op;
+}
+
+/*
+ * lz_decompress
+ * return 0 if success
+ */
+int lz_decompress(const unsigned char *src, unum size, unsigned char *dst, unum raw_size) {
+    unum ip = 0;
+    unum op = 0;
+    while (ip < size) {
+        unsigned char token = src[ip++];
+        unum literal = token >> 4;
+        if (literal == 15) {
+            unsigned char c;
+            do {
+                if (ip >= size)
+                    return -1;
+                c = src[ip++];
+                literal += c;
+            } while (c == 255);
+        }
+        if (op + literal > raw_size || ip + literal > size)
+            return -1;
+        memcpy(&dst[op], &src[ip], literal);
+        op += literal;
+        ip += literal;
+        if (ip >= size)
+            break;
+        // offset is 2 bytes
+        if (ip + 2 > size)
+            return -1;
+        unum offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        unum match = (token & 0x0F);
+        if (match == 15) {
+            unsigned char c;
+            do {
+                if (ip >= size)
+                    return -1;
+                c = src[ip++];
+                match += c;
+            } while (c == 255);
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + match > raw_size)
+            return -1;
+        // may overlap
+        unum i;
+        for (i = 0; i < match; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op == raw_size ? 0 : -1;
+}
+
+/*
+ * cold_store_malloc
+ * budget_bytes is limit of decompressed blocks kept
+ */
+struct cold_store *cold_store_malloc(unum budget_bytes) {
+    struct cold_store *store = (struct cold_store *)malloc(sizeof(struct cold_store));
+    memset(store, 0, sizeof(struct cold_store));
+    store->budget_bytes = budget_bytes;
+    return store;
+}
+
+/*
+ * cold_lru_remove
+ * unlink from LRU and free decompressed bytes
+ */
+void cold_lru_remove(struct cold_block *block) {
+    struct cold_store *store = block->store;
+    if (!block->raw)
+        return;
+    if (block->lru_prev)
+        block->lru_prev->lru_next = block->lru_next;
+    else
+        store->lru_head = block->lru_next;
+    if (block->lru_next)
+        block->lru_next->lru_prev = block->lru_prev;
+    else
+        store->lru_tail = block->lru_prev;
+    store->cache_bytes -= block->raw_size;
+    free(block->raw);
+    block->raw = NULL;
+    block->lru_prev = NULL;
+    block->lru_next = NULL;
+}
+
+/*
+ * cold_block_raw
+ * decompressed bytes of block, kept in LRU until over budget
+ */
+unsigned char *cold_block_raw(struct cold_block *block) {
+    struct cold_store *store = block->store;
+    if (block->raw) {
+        // move to head
+        if (store->lru_head != block) {
+            block->lru_prev->lru_next = block->lru_next;
+            if (block->lru_next)
+                block->lru_next->lru_prev = block->lru_prev;
+            else
+                store->lru_tail = block->lru_prev;
+            block->lru_prev = NULL;
+            block->lru_next = store->lru_head;
+            store->lru_head->lru_prev = block;
+            store->lru_head = block;
+        }
+        return block->raw;
+    }
+    block->raw = (unsigned char *)malloc(block->raw_size + 1);
+    if (lz_decompress(block->data, block->data_size, block->raw, block->raw_size) != 0) {
+        fprintf(stderr, "broken cold block\n");
+        exit(EXIT_FAILURE);
+    }
+    block->lru_prev = NULL;
+    block->lru_next = store->lru_head;
+    if (store->lru_head)
+        store->lru_head->lru_prev = block;
+    else
+        store->lru_tail = block;
+    store->lru_head = block;
+    store->cache_bytes += block->raw_size;
+    while (store->cache_bytes > store->budget_bytes && store->lru_tail != block)
+        cold_lru_remove(store->lru_tail);
+    return block->raw;
+}
+
+/*
+ * text_relink
+ * rows from first to last are moved, fix neighbors and head of context
+ */
+void text_relink(struct context *context, struct text *first, struct text *last) {
+    if (first->prev)
+        first->prev->next = first;
+    else
+        context->text = first;
+    if (last->next)
+        last->next->prev = last;
+}
+
+/*
+ * cold_block_freeze
+ * compress rows from first (row top) and free their lines
+ * rows are moved into one array of block, so freed pages can be given back
+ */
+struct cold_block *cold_block_freeze(struct context *context, struct text *first, unum top, unum row_count) {
+    struct cold_store *store = context->cold_store;
+    unum raw_size = 0;
+    unum i;
+    struct text *current = first;
+    for (i = 0; i < row_count; i++, current = current->next)
+        raw_size += current->byte_count;
+    unsigned char *raw = (unsigned char *)malloc(raw_size + 1);
+    unum offset = 0;
+    current = first;
+    for (i = 0; i < row_count; i++, current = current->next) {
+        struct line *line = current->line;
+        while (line) {
+            memcpy(&raw[offset], line->string, line->byte_count);
+            offset += line->byte_count;
+            line = line->next;
+        }
+    }
+    struct cold_block *block = (struct cold_block *)malloc(sizeof(struct cold_block));
+    unsigned char *data = (unsigned char *)malloc(lz_bound(raw_size));
+    block->data_size = lz_compress(raw, raw_size, data);
+    block->data = (unsigned char *)realloc(data, block->data_size + 1);
+    free(raw);
+    block->store = store;
+    block->rows = (struct text *)malloc(sizeof(struct text) * row_count);
+    block->row_count = row_count;
+    block->raw_size = raw_size;
+    block->raw = NULL;
+    block->lru_prev = NULL;
+    block->lru_next = NULL;
+    block->seek_row = NULL;
+    block->seek_offset = 0;
+    struct text *prev = first->prev;
+    current = first;
+    for (i = 0; i < row_count; i++) {
+        struct text *next = current->next;
+        struct text *row = &block->rows[i];
+        *row = *current;
+        line_list_free(row->line);
+        row->line = NULL;
+        row->cold = block;
+        row->prev = prev;
+        row->next = i + 1 < row_count ? &block->rows[i + 1] : next;
+        if (context->row_index.is_valid)
+            *row_index_slot(&context->row_index, top - 1 + i) = row;
+        free(current);
+        prev = row;
+        current = next;
+    }
+    text_relink(context, block->rows, &block->rows[row_count - 1]);
+    store->block_count++;
+    store->row_count += row_count;
+    store->data_bytes += block->data_size;
+    store->raw_bytes += raw_size;
+    store->is_trim_needed = 1;
+    return block;
+}
+
+/*
+ * cold_block_thaw
+ * make rows and lines of block (first is row top) again and free block
+ */
+void cold_block_thaw(struct context *context, struct cold_block *block, unum top) {
+    struct cold_store *store = block->store;
+    unsigned char *raw = cold_block_raw(block);
+    struct text_decoder decoder;
+    unum offset = 0;
+    unum i;
+    struct text *prev = block->rows[0].prev;
+    struct text *first = NULL;
+    for (i = 0; i < block->row_count; i++) {
+        struct text *current = (struct text *)malloc(sizeof(struct text));
+        *current = block->rows[i];
+        current->prev = prev;
+        if (prev && i > 0)
+            prev->next = current;
+        if (!first)
+            first = current;
+        current->cold = NULL;
+        current->line = (struct line *)malloc(sizeof(struct line));
+        current->line->next = NULL;
+        current->line->byte_count = 0;
+        // decoder without new row, bytes of row has \n only at tail
+        decoder.head = current;
+        decoder.current_text = current;
+        decoder.current_line = current->line;
+        decoder.len = 0;
+        decoder.is_raw = 0;
+        mbcher_zero_clear(decoder.buf);
+        unum size = current->byte_count;
+        if (current->next && size > 0)
+            size--;
+        text_decoder_feed(&decoder, &raw[offset], size);
+        if (size < current->byte_count)
+            line_add_char(decoder.current_line, &raw[offset + size]);
+        offset += current->byte_count;
+        calculation_text_width(current);
+        if (context->row_index.is_valid)
+            *row_index_slot(&context->row_index, top - 1 + i) = current;
+        prev = current;
+    }
+    text_relink(context, first, prev);
+    store->block_count--;
+    store->row_count -= block->row_count;
+    store->data_bytes -= block->data_size;
+    store->raw_bytes -= block->raw_size;
+    cold_lru_remove(block);
+    free(block->data);
+    free(block->rows);
+    free(block);
+}
+
+/*
+ * text_thaw
+ * call before touching line of text (row position_y)
+ * return text, it is moved if compressed
+ */
+struct text *text_thaw(struct context *context, struct text *text, unum position_y) {
+    if (!text || !text->cold)
+        return text;
+    struct cold_block *block = text->cold;
+    unum index = text - block->rows;
+    struct text *first = block->rows[0].prev;
+    cold_block_thaw(context, block, position_y - index);
+    struct text *current = first ? first->next : context->text;
+    while (index--)
+        current = current->next;
+    return current;
+}
+
+/*
+ * context_thaw_rows
+ * thaw rows from top to bottom
+ */
+void context_thaw_rows(struct context *context, unum top, unum bottom) {
+    if (!context->cold_store)
+        return;
+    struct text *current = context_text_at(context, top);
+    for (; current && top <= bottom; top++, current = current->next)
+        current = text_thaw(context, current, top);
+}
+
+/*
+ * cold_row_bytes
+ * bytes of compressed row without thaw, for read only
+ */
+unsigned char *cold_row_bytes(struct text *text) {
+    struct cold_block *block = text->cold;
+    unsigned char *raw = cold_block_raw(block);
+    unum offset = 0;
+    if (block->seek_row && block->seek_row->next == text) {
+        offset = block->seek_offset + block->seek_row->byte_count;
+    } else if (block->seek_row != text) {
+        struct text *current = block->rows;
+        while (current != text) {
+            offset += current->byte_count;
+            current = current->next;
+        }
+    } else {
+        offset = block->seek_offset;
+    }
+    block->seek_row = text;
+    block->seek_offset = offset;
+    return &raw[offset];
+}
+
+/*
+ * cold_sweep
+ * compress rows far from cursor and view in a time slice
+ * return 1 if whole text is swept
+ */
+int cold_sweep(struct context *context) {
+    struct cold_store *store = context->cold_store;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unum count = context_row_count(context);
+    unum keep_top = context->cursor.position_y > COLD_KEEP_ROWS ? context->cursor.position_y - COLD_KEEP_ROWS : 1;
+    unum keep_bottom = context->cursor.position_y + COLD_KEEP_ROWS;
+    unum view_top = context->render_start_height + 1;
+    unum view_bottom = context->render_start_height + context->body_height;
+    if (store->sweep_y < 1)
+        store->sweep_y = 1;
+    while (store->sweep_y <= count) {
+        unum top = store->sweep_y;
+        unum bottom = top + COLD_BLOCK_ROWS - 1;
+        // last row is left hot for append
+        if (bottom >= count)
+            break;
+        struct text *first = context_text_at(context, top);
+        if (!(bottom < keep_top || top > keep_bottom)) {
+            store->sweep_y = keep_bottom + 1;
+        } else if (!(bottom < view_top || top > view_bottom)) {
+            store->sweep_y = view_bottom + 1;
+        } else if (first->cold) {
+            store->sweep_y = first->cold->rows == first ? top + first->cold->row_count : top + 1;
+        } else {
+            unum i;
+            struct text *current = first;
+            for (i = 0; i < COLD_BLOCK_ROWS && !current->cold; i++)
+                current = current->next;
+            if (i == COLD_BLOCK_ROWS) {
+                cold_block_freeze(context, first, top, COLD_BLOCK_ROWS);
+                store->sweep_y = bottom + 1;
+            } else {
+                // hot rows before cold block are left
+                store->sweep_y = top + i;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000000000LL + (now.tv_nsec - start.tv_nsec) > COLD_SLICE_NS)
+            return 0;
+    }
+    store->sweep_y = 1;
+    // freed rows and lines are given back to os
+    if (store->is_trim_needed)
+        malloc_trim(0);
+    store->is_trim_needed = 0;
+    return 1;
+}
+
+/*
+ * text_compact
+ * lay chunks of row again if a chunk can take head char of next one
+ * return 1 if row is laid again
+ */
+int text_compact(struct text *text) {
+    if (text->cold)
+        return 0;
+    struct line *line = text->line;
+    while (line->next) {
+        if (line->next->byte_count == 0
+                || line->byte_count + safed_mbchar_size(line->next->string) < BUFFER_SIZE)
+            break;
+        line = line->next;
+    }
+    if (!line->next)
+        return 0;
+    // new chunks are malloced in a row, close in heap
+    unsigned char *bytes = (unsigned char *)malloc(text->byte_count + 1);
+    unum size = 0;
+    for (line = text->line; line; line = line->next) {
+        memcpy(&bytes[size], line->string, line->byte_count);
+        size += line->byte_count;
+    }
+    line_list_free(text->line);
+    struct line *head = (struct line *)malloc(sizeof(struct line));
+    head->next = NULL;
+    head->byte_count = 0;
+    head->position_count = 0;
+    line = head;
+    unum i = 0;
+    while (i < size) {
+        unsigned int s = safed_mbchar_size(&bytes[i]);
+        // same fill as line_add_char
+        if (line->byte_count + s >= BUFFER_SIZE) {
+            line = line_insert(line);
+            line->position_count = 0;
+        }
+        memcpy(&line->string[line->byte_count], &bytes[i], s);
+        line->byte_count += s;
+        line->position_count++;
+        i += s;
+    }
+    free(bytes);
+    text->line = head;
+    return 1;
+}
+
+/*
+ * compaction_mark
+ * rows from top to bottom are edited, pass is started again over edited rows
+ */
+void compaction_mark(struct context *context, unum top, unum bottom) {
+    struct compaction *compaction = &context->compaction;
+    unum count = context_row_count(context);
+    unum rest = bottom < count ? count - bottom : 0;
+    if (compaction->is_done || top < compaction->top)
+        compaction->top = top;
+    if (compaction->is_done || rest < compaction->bottom_rest)
+        compaction->bottom_rest = rest;
+    compaction->is_done = 0;
+    compaction->y = 0;
+}
+
+/*
+ * compaction_sweep
+ * compact edited rows in a time slice, report fill ratio when pass ends
+ * return 1 if edited rows are swept
+ */
+int compaction_sweep(struct context *context) {
+    struct compaction *compaction = &context->compaction;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (compaction->y == 0) {
+        compaction->y = compaction->top;
+        compaction->row_count = 0;
+        compaction->payload_bytes = 0;
+        compaction->line_count_before = 0;
+        compaction->line_count_after = 0;
+    }
+    unum count = context_row_count(context);
+    unum bottom = compaction->bottom_rest < count ? count - compaction->bottom_rest : 0;
+    struct text *text = context_text_at(context, compaction->y);
+    while (text && compaction->y <= bottom) {
+        struct line *line;
+        unum before = 0;
+        for (line = text->line; line; line = line->next)
+            before++;
+        if (text_compact(text)) {
+            compaction->row_count++;
+            compaction->line_count_before += before;
+            for (line = text->line; line; line = line->next)
+                compaction->line_count_after++;
+            compaction->payload_bytes += text->byte_count;
+        }
+        text = text->next;
+        compaction->y++;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000000000LL + (now.tv_nsec - start.tv_nsec) > COMPACT_SLICE_NS)
+            return 0;
+    }
+    compaction->y = 0;
+    if (compaction->row_count) {
+        malloc_trim(0);
+        if (!context->message[0])
+            snprintf((char *)context->message, sizeof(context->message), "compacted %llu rows, chunk fill %.1f%% -> %.1f%%",
+                compaction->row_count,
+                100.0 * compaction->payload_bytes / (compaction->line_count_before * BUFFER_SIZE),
+                100.0 * compaction->payload_bytes / (compaction->line_count_after * BUFFER_SIZE));
+    }
+    return 1;
+}
+
+/*
+ * cursor_compare
+ * negative if a is before b
+ */
+int cursor_compare(struct cursor a, struct cursor b) {
+    if (a.position_y != b.position_y)
+        return a.position_y < b.position_y ? -1 : 1;
+    if (a.position_x != b.position_x)
+        return a.position_x < b.position_x ? -1 : 1;
+    return 0;
+}
+
+/*
+ * region_get
+ * sort mark and cursor
+ * return 0 if no selection
+ */
+int region_get(const struct context *context, struct cursor *start, struct cursor *end) {
+    if (!context->mark_active)
+        return 0;
+    if (cursor_compare(context->mark, context->cursor) <= 0) {
+        *start = context->mark;
+        *end = context->cursor;
+    } else {
+        *start = context->cursor;
+        *end = context->mark;
+    }
+    return cursor_compare(*start, *end) != 0;
+}
+
+/*
+ * region_cut
+ * splice [start, end) out of document, chars are not copied
+ * return detached rows
+ */
+struct clipboard region_cut(struct context *context, struct cursor start, struct cursor end) {
+    struct clipboard cut;
+    cut.is_borrowed = 0;
+    context_thaw_rows(context, start.position_y, end.position_y);
+    struct text *first = context_text_at(context, start.position_y);
+    cut.head = text_malloc();
+    free(cut.head->line);
+    if (start.position_y == end.position_y) {
+        struct line *middle = line_cut(&first->line, start.position_x);
+        struct line *rest = line_cut(&middle, end.position_x - start.position_x + 1);
+        line_append(&first->line, rest);
+        cut.head->line = middle;
+        cut.tail = cut.head;
+        cut.rows = NULL;
+        cut.row_count = 0;
+    } else {
+        struct text *last = context_text_at(context, end.position_y);
+        cut.head->line = line_cut(&first->line, start.position_x);
+        struct line *rest = line_cut(&last->line, end.position_x);
+        line_append(&first->line, rest);
+        // rows between first and last keep their calculated width
+        cut.head->next = first->next;
+        first->next->prev = cut.head;
+        first->next = last->next;
+        if (last->next)
+            last->next->prev = first;
+        last->next = NULL;
+        cut.tail = last;
+        cut.row_count = end.position_y - start.position_y;
+        cut.rows = (struct text **)malloc(sizeof(struct text *) * cut.row_count);
+        if (!row_index_remove_rows(context, start.position_y + 1, cut.row_count, cut.rows)) {
+            free(cut.rows);
+            cut.rows = NULL;
+        }
+    }
+    text_drop_empty_line(first);
+    text_drop_empty_line(cut.head);
+    text_drop_empty_line(cut.tail);
+    calculation_text_width(first);
+    calculation_text_width(cut.head);
+    calculation_text_width(cut.tail);
+    return cut;
+}
+
+/*
+ * text_copy_bytes
+ * copy bytes of positions from from_x before to_x (0 is to tail), read only
+ * return size copied
+ */
+unum text_copy_bytes(struct text *text, unum from_x, unum to_x, unsigned char *out) {
+    unum size = 0;
+    unum pos = 1;
+    struct line *current_line = text->line;
+    // compressed row is read as one segment without thaw
+    unsigned char *segment = text->cold ? cold_row_bytes(text) : NULL;
+    unum segment_size = text->cold ? text->byte_count : 0;
+    unum segment_position = text->cold ? text->position_count : 0;
+    while ((segment || current_line) && (to_x == 0 || pos < to_x)) {
+        if (!segment) {
+            segment = current_line->string;
+            segment_size = current_line->byte_count;
+            segment_position = current_line->position_count;
+            current_line = current_line->next;
+        }
+        if (pos >= from_x && (to_x == 0 || pos + segment_position <= to_x)) {
+            // whole chunk
+            memcpy(&out[size], segment, segment_size);
+            size += segment_size;
+            pos += segment_position;
+        } else {
+            unum i = 0;
+            while (i < segment_size && (to_x == 0 || pos < to_x)) {
+                unsigned int s = safed_mbchar_size(&segment[i]);
+                if (pos >= from_x) {
+                    memcpy(&out[size], &segment[i], s);
+                    size += s;
+                }
+                i += s;
+                pos++;
+            }
+        }
+        segment = NULL;
+    }
+    return size;
+}
+
+/*
+ * line_from_bytes
+ * chunks of bytes, same fill as line_add_char
+ */
+struct line *line_from_bytes(const unsigned char *bytes, unum size) {
+    struct line *head = (struct line *)malloc(sizeof(struct line));
+    head->next = NULL;
+    head->byte_count = 0;
+    struct line *line = head;
+    unum i = 0;
+    while (i < size) {
+        unsigned int s = safed_mbchar_size((mbchar)&bytes[i]);
+        if (line->byte_count + s >= BUFFER_SIZE)
+            line = line_insert(line);
+        memcpy(&line->string[line->byte_count], &bytes[i], s);
+        line->byte_count += s;
+        i += s;
+    }
+    return head;
+}
+
+/*
+ * region_clone
+ * detached copy of [start, end), document is only read
+ */
+struct clipboard region_clone(struct context *context, struct cursor start, struct cursor end) {
+    struct clipboard clone;
+    clone.head = NULL;
+    clone.tail = NULL;
+    clone.is_borrowed = 0;
+    clone.row_count = end.position_y - start.position_y;
+    clone.rows = (struct text **)malloc(sizeof(struct text *) * (clone.row_count + 1));
+    unsigned char *bytes = NULL;
+    unum capacity = 0;
+    struct text *current = context_text_at(context, start.position_y);
+    unum y;
+    for (y = start.position_y; y <= end.position_y && current; y++, current = current->next) {
+        struct text *text = text_insert(clone.tail);
+        if (clone.head)
+            clone.rows[y - start.position_y - 1] = text;
+        else
+            clone.head = text;
+        clone.tail = text;
+        free(text->line);
+        if (!current->cold && (y > start.position_y || start.position_x == 1) && y < end.position_y) {
+            // whole row, counts are same
+            text->line = line_clone(current->line);
+            text->width_count = current->width_count;
+            text->position_count = current->position_count;
+            text->byte_count = current->byte_count;
+            continue;
+        }
+        if (capacity < current->byte_count + 1) {
+            capacity = current->byte_count + 1;
+            bytes = (unsigned char *)realloc(bytes, capacity);
+        }
+        unum size = text_copy_bytes(current, y == start.position_y ? start.position_x : 1,
+            y == end.position_y ? end.position_x : 0, bytes);
+        text->line = line_from_bytes(bytes, size);
+        calculation_text_width(text);
+    }
+    free(bytes);
+    return clone;
+}
+
+/*
+ * clipboard_range
+ * borrowed range at now, rows are counted from tail after edit above
+ */
+void clipboard_range(struct context *context, struct cursor *start, struct cursor *end) {
+    struct clipboard *clipboard = &context->clipboard;
+    *start = clipboard->start;
+    *end = clipboard->end;
+    if (clipboard->is_tail_anchor) {
+        end->position_y = context_row_count(context) - clipboard->rest;
+        start->position_y = end->position_y - (clipboard->end.position_y - clipboard->start.position_y);
+    }
+}
+
+/*
+ * clipboard_before_edit
+ * rows from top to bottom will be changed
+ * borrowed range is cloned if touched, else counted from the side not edited
+ */
+void clipboard_before_edit(struct context *context, unum top, unum bottom) {
+    struct clipboard *clipboard = &context->clipboard;
+    if (!clipboard->is_borrowed)
+        return;
+    struct cursor start, end;
+    clipboard_range(context, &start, &end);
+    if (top <= end.position_y && bottom >= start.position_y) {
+        *clipboard = region_clone(context, start, end);
+        return;
+    }
+    clipboard->start = start;
+    clipboard->end = end;
+    clipboard->is_tail_anchor = bottom < start.position_y;
+    if (clipboard->is_tail_anchor)
+        clipboard->rest = context_row_count(context) - end.position_y;
+}
+
+/*
+ * clipboard_paste
+ * splice rows of clipboard to at, cut rows are moved not copied
+ * pasted rows are kept borrowed, they are cloned for next paste
+ * return cursor after pasted
+ */
+struct cursor clipboard_paste(struct context *context, struct cursor at) {
+    struct clipboard *clipboard = &context->clipboard;
+    if (clipboard->is_borrowed) {
+        struct cursor start, end;
+        clipboard_range(context, &start, &end);
+        *clipboard = region_clone(context, start, end);
+    }
+    struct text *head = clipboard->head;
+    struct text *tail = clipboard->tail;
+    struct text *current = context_text_at(context, at.position_y);
+    current = text_thaw(context, current, at.position_y);
+    struct line *rest = line_cut(&current->line, at.position_x);
+    struct cursor after = at;
+    struct text *last = current;
+    if (head == tail) {
+        after.position_x += head->position_count;
+    } else {
+        after.position_x = tail->position_count + 1;
+        after.position_y += clipboard->row_count;
+        struct text *middle = head->next;
+        middle->prev = current;
+        tail->next = current->next;
+        if (current->next)
+            current->next->prev = tail;
+        current->next = middle;
+        if (clipboard->rows)
+            row_index_insert_slots(context, at.position_y + 1, clipboard->rows, clipboard->row_count);
+        else
+            row_index_insert_rows(context, at.position_y + 1, middle, tail);
+        last = tail;
+    }
+    line_append(&current->line, head->line);
+    free(head);
+    line_append(&last->line, rest);
+    text_drop_empty_line(current);
+    calculation_text_width(current);
+    if (last != current) {
+        text_drop_empty_line(last);
+        calculation_text_width(last);
+    }
+    free(clipboard->rows);
+    clipboard->head = NULL;
+    clipboard->tail = NULL;
+    clipboard->rows = NULL;
+    clipboard->is_borrowed = 1;
+    clipboard->is_tail_anchor = 0;
+    clipboard->start = at;
+    clipboard->end = after;
+    return after;
+}
+
+/*
+ * clipboard_free
+ * free cut rows, borrowed range is only forgotten
+ */
+void clipboard_free(struct clipboard *clipboard) {
+    text_list_free(clipboard->head);
+    free(clipboard->rows);
+    clipboard->head = NULL;
+    clipboard->tail = NULL;
+    clipboard->rows = NULL;
+    clipboard->is_borrowed = 0;
+}
+
+/*
+ * heap_block_size
+ * estimate of glibc malloc chunk for size (8 byte header, 16 byte align)
+ */
+unum heap_block_size(unum size) {
+    unum block = (size + 8 + 15) & ~(unum)15;
+    if (block < 32)
+        block = 32;
+    return block;
+}
+
+/*
+ * memory_report_collect
+ * count struct text, struct line and its bytes
+ */
+struct memory_report memory_report_collect(struct text *head) {
+    struct memory_report report;
+    memset(&report, 0, sizeof(report));
+    struct text *current_text = head;
+    struct line *current_line;
+    while (current_text) {
+        report.text_count++;
+        if (current_text->cold) {
+            struct cold_block *block = current_text->cold;
+            report.cold_row_count++;
+            if (block->rows == current_text) {
+                report.cold_block_count++;
+                report.cold_raw_bytes += block->raw_size;
+                report.cold_data_bytes += block->data_size;
+                report.heap_bytes += heap_block_size(sizeof(struct cold_block)) + heap_block_size(block->data_size + 1)
+                    + heap_block_size(sizeof(struct text) * block->row_count);
+                if (block->raw)
+                    report.heap_bytes += heap_block_size(block->raw_size + 1);
+            }
+        }
+        current_line = current_text->line;
+        while (current_line) {
+            report.line_count++;
+            if (current_line->byte_count == 0)
+                report.empty_line_count++;
+            report.payload_bytes += current_line->byte_count;
+            current_line = current_line->next;
+        }
+        current_text = current_text->next;
+    }
+    report.capacity_bytes = report.line_count * BUFFER_SIZE;
+    report.struct_bytes = report.text_count * sizeof(struct text) + report.line_count * sizeof(struct line);
+    // compressed rows are in array of block
+    report.heap_bytes += (report.text_count - report.cold_row_count) * heap_block_size(sizeof(struct text)) + report.line_count * heap_block_size(sizeof(struct line));
+    return report;
+}
+
+/*
+ * memory_report_format
+ * one line summary for footer
+ */
+void memory_report_format(struct memory_report report, unsigned char *out, unsigned int size) {
+    double fill = report.capacity_bytes ? 100.0 * report.payload_bytes / report.capacity_bytes : 0;
+    unum document_bytes = report.payload_bytes + report.cold_raw_bytes;
+    double amplification = document_bytes ? (double)report.heap_bytes / document_bytes : 0;
+    int length = snprintf((char *)out, size, "rows:%llu chunks:%llu(empty %llu) payload:%lluB overhead:%lluB fill:%.1f%% heap:x%.2f",
+        report.text_count, report.line_count, report.empty_line_count, report.payload_bytes,
+        report.heap_bytes - report.payload_bytes, fill, amplification);
+    if (report.cold_row_count && length > 0 && (unsigned int)length < size)
+        snprintf((char *)out + length, size - length, " cold:%llu rows %lluB->%lluB",
+            report.cold_row_count, report.cold_raw_bytes, report.cold_data_bytes);
+}
+
+/*
+ * memory_report_dump
+ * key value per line, for headless
+ */
+void memory_report_dump(FILE *fp, struct memory_report report) {
+    fprintf(fp, "text_count %llu\n", report.text_count);
+    fprintf(fp, "text_struct_size %zu\n", sizeof(struct text));
+    fprintf(fp, "line_count %llu\n", report.line_count);
+    fprintf(fp, "line_struct_size %zu\n", sizeof(struct line));
+    fprintf(fp, "empty_line_count %llu\n", report.empty_line_count);
+    fprintf(fp, "payload_bytes %llu\n", report.payload_bytes);
+    fprintf(fp, "capacity_bytes %llu\n", report.capacity_bytes);
+    fprintf(fp, "struct_bytes %llu\n", report.struct_bytes);
+    fprintf(fp, "heap_bytes %llu\n", report.heap_bytes);
+    fprintf(fp, "overhead_bytes %llu\n", report.heap_bytes - report.payload_bytes);
+    fprintf(fp, "fill_ratio %.4f\n", report.capacity_bytes ? (double)report.payload_bytes / report.capacity_bytes : 0);
+    fprintf(fp, "bytes_per_payload_byte %.4f\n", report.payload_bytes ? (double)report.heap_bytes / report.payload_bytes : 0);
+    fprintf(fp, "cold_row_count %llu\n", report.cold_row_count);
+    fprintf(fp, "cold_block_count %llu\n", report.cold_block_count);
+    fprintf(fp, "cold_raw_bytes %llu\n", report.cold_raw_bytes);
+    fprintf(fp, "cold_data_bytes %llu\n", report.cold_data_bytes);
+}
+
+/*
+ * mbchar_malloc
+ * malloc size of multi byte
+ * return memory
+ */
+mbchar mbchar_malloc(void) {
+    return (mbchar)malloc(sizeof(unsigned char) * UTF8_MAX_BYTE);
+}
+
+/*
+ * mbchar_free
+ * free multi byte
+ */
+void mbchar_free(mbchar mbchar) {
+    free(mbchar);
+    mbchar = NULL;
+}
+
+/*
+ * mbchar_zero_clear
+ * fill mbchar with \0
+ */
+mbchar mbcher_zero_clear(mbchar mbchar) {
+    unsigned int i = UTF8_MAX_BYTE;
+    while(i--)
+        mbchar[i] = '\0';
+    return mbchar;
+}
+
+/*
+ * mbchar_size
+ * return size of multi byte char
+ */
+int mbchar_size(mbchar mbchar, unsigned int len) {
+    if (len < 1 || UTF8_MAX_BYTE < len)
+        return MBCHAR_ILLIEGAL;
+    if (len == 1 && mbchar[0] == 0x00)
+        return MBCHAR_NULL;
+    // length of mbchar is determined by number of head 1 in byte
+    unsigned int head_one_bits = 0;
+    while (head_one_bits < 8) {
+        if ((mbchar[0] >> (7 - head_one_bits) & 0x01) == 1)
+            head_one_bits++;
+        else
+            break;
+    }
+    if (head_one_bits == 0)
+        // if head 1 bit is 0, that is 1 byte char
+        // for compare to len
+        head_one_bits++;
+    if (head_one_bits > len)
+        return MBCHAR_NOT_FILL;
+    if (head_one_bits == len) {
+        switch(len) {
+        case 1:
+            return len;
+            break;
+        case 2:
+            if (mbchar[0] & 0x1e)
+                return len;
+            break;
+        case 3:
+            if (mbchar[0] & 0x0f || mbchar[1] & 0x20)
+                return len;
+            break;
+        case 4:
+            if (mbchar[0] & 0x07 || mbchar[1] & 0x30)
+                return len;
+            break;
+        case 5:
+            if (mbchar[0] & 0x03 || mbchar[1] & 0x38)
+                return len;
+            break;
+        case 6:
+            if (mbchar[0] & 0x01 || mbchar[1] & 0x3c)
+                return len;
+            break;
+        }
+    }
+    return MBCHAR_ILLIEGAL;
+}
+
+/*
+ * safed_mbchar_size
+ * uses only head_one_bits
+ * return size of multi byte char
+ */
+unsigned int safed_mbchar_size(mbchar mbchar) {
+    unsigned int head_one_bits = 0;
+    while (head_one_bits < 8) {
+        if ((mbchar[0] >> (7 - head_one_bits) & 0x01) == 1)
+            head_one_bits++;
+        else
+            break;
+    }
+    if (head_one_bits == 0)
+        head_one_bits++;
+    return head_one_bits;
+}
+
+/*
+ * is_line_break
+ * return 1 if char is \n
+ */
+int is_line_break(mbchar mbchar) {
+    if (mbchar[0] == '\n')
+        return 1;
+    return 0;
 }
 
 /*
  * mbchar_width
  * return char display width(multi is const 2)
  */
-unsigned int mbchar_width(mbchar mbchar) {
-    if (safed_mbchar_size(mbchar) > 1)
-        return 2;
-    else
-        return 1;
+unsigned int mbchar_width(mbchar mbchar) {
+    if (safed_mbchar_size(mbchar) > 1)
+        return 2;
+    else
+        return 1;
+}
+
+/*
+ * string_width
+ * return string display width
+ */
+unum string_width(unsigned char *message) {
+    unsigned int width = 0;
+    long max_byte = strlen((char *)message);
+    unsigned int i = 0;
+    while(i < max_byte) {
+        width += mbchar_width(&message[i]);
+        i += safed_mbchar_size(&message[i]);
+    }
+    return width;
+}
+
+/*
+ * console_size
+ * return console size
+ */
+struct view_size console_size(void) {
+    struct view_size view_size;
+    view_size.width = 0;
+    view_size.height = 0;
+    
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) {
+        fprintf(stderr, "ioctl error\n");
+        exit(EXIT_FAILURE);
+    } else {
+        view_size.width = ws.ws_col;
+        view_size.height = ws.ws_row;
+    }
+    return view_size;
+}
+
+/*
+ * text_decoder_init
+ * start with empty head
+ */
+void text_decoder_init(struct text_decoder *decoder) {
+    decoder->head = text_malloc();
+    decoder->current_text = decoder->head;
+    decoder->current_line = decoder->head->line;
+    mbcher_zero_clear(decoder->buf);
+    decoder->len = 0;
+    decoder->is_raw = 1;
+    decoder->escape_count = 0;
+}
+
+/*
+ * text_decoder_add
+ * add one mbchar to tail
+ */
+void text_decoder_add(struct text_decoder *decoder, mbchar mc) {
+    line_add_char(decoder->current_line, mc);
+    while (decoder->current_line->next)
+        decoder->current_line = decoder->current_line->next;
+    if (is_line_break(mc)) {
+        decoder->current_text = text_insert(decoder->current_text);
+        decoder->current_line = decoder->current_text->line;
+    }
+}
+
+/*
+ * is_raw_illegal
+ * mbchar from file which can not be shown as utf-8
+ * continuation byte at head, broken continuation, surrogate, longer than 4 bytes
+ */
+int is_raw_illegal(mbchar mbchar, int size) {
+    if (size == 1)
+        return mbchar[0] >= 0x80;
+    if (size > 4)
+        return 1;
+    int i;
+    for (i = 1; i < size; i++)
+        if ((mbchar[i] & 0xC0) != 0x80)
+            return 1;
+    return size == 3 && mbchar[0] == 0xED && mbchar[1] >= 0xA0;
+}
+
+/*
+ * text_decoder_feed
+ * add bytes to tail, mbchar may be divided between feeds
+ * illegal bytes from file are escaped, they are written back as they were
+ */
+void text_decoder_feed(struct text_decoder *decoder, const unsigned char *bytes, size_t size) {
+    size_t i;
+    int mbsize;
+    for (i = 0; i < size; i++) {
+        decoder->buf[decoder->len] = bytes[i];
+        mbsize = mbchar_size(decoder->buf, decoder->len + 1);
+        if (mbsize == MBCHAR_NOT_FILL && decoder->len + 1 < UTF8_MAX_BYTE) {
+            // not valid
+            decoder->len++;
+        } else if (mbsize > 0 && !(decoder->is_raw && is_raw_illegal(decoder->buf, mbsize))) {
+            text_decoder_add(decoder, decoder->buf);
+            mbcher_zero_clear(decoder->buf);
+            decoder->len = 0;
+        } else if (decoder->is_raw) {
+            // escape first byte, rest is read again
+            unsigned char first = decoder->buf[0];
+            unsigned char rest[UTF8_MAX_BYTE];
+            unsigned int rest_len = decoder->len;
+            memcpy(rest, &decoder->buf[1], rest_len);
+            mbcher_zero_clear(decoder->buf);
+            escape_byte(first, decoder->buf);
+            decoder->len = 0;
+            text_decoder_add(decoder, decoder->buf);
+            decoder->escape_count++;
+            mbcher_zero_clear(decoder->buf);
+            text_decoder_feed(decoder, rest, rest_len);
+        } else {
+			mbcher_zero_clear(decoder->buf);
+            decoder->len = 0;
+		}
+    }
+}
+
+/*
+ * text_decoder_finish
+ * escape bytes left at end of file
+ */
+void text_decoder_finish(struct text_decoder *decoder, struct transcoder *tc) {
+    unsigned char out[16];
+    if (tc && tc->pending_len)
+        text_decoder_feed(decoder, out, transcoder_flush(tc, out));
+    if (!decoder->is_raw || decoder->len == 0)
+        return;
+    unsigned char rest[UTF8_MAX_BYTE];
+    unsigned int rest_len = decoder->len;
+    memcpy(rest, decoder->buf, rest_len);
+    mbcher_zero_clear(decoder->buf);
+    decoder->len = 0;
+    unsigned int i;
+    for (i = 0; i < rest_len; i++) {
+        escape_byte(rest[i], decoder->buf);
+        text_decoder_add(decoder, decoder->buf);
+        decoder->escape_count++;
+    }
+    mbcher_zero_clear(decoder->buf);
+}
+
+/*
+ * text_decoder_feed_file
+ * bytes of file in encoding of tc, BOM is skipped
+ */
+void text_decoder_feed_file(struct text_decoder *decoder, struct transcoder *tc, const unsigned char *bytes, size_t size) {
+    while (tc->bom_left && size) {
+        bytes++;
+        size--;
+        tc->bom_left--;
+    }
+    if (tc->encoding == ENCODING_UTF8) {
+        text_decoder_feed(decoder, bytes, size);
+        return;
+    }
+    // output of transcoder is utf-8 with escapes already
+    decoder->is_raw = 0;
+    unsigned char out[TRANSCODE_SLICE * 3 + 16];
+    while (size) {
+        size_t slice = size < TRANSCODE_SLICE ? size : TRANSCODE_SLICE;
+        text_decoder_feed(decoder, out, transcoder_decode(tc, bytes, slice, out));
+        bytes += slice;
+        size -= slice;
+    }
+}
+
+/*
+ * escape_byte
+ * byte to U+DC00 + byte in utf-8
+ */
+void escape_byte(unsigned char byte, unsigned char *out) {
+    out[0] = 0xED;
+    out[1] = 0xB0 | (byte >> 6);
+    out[2] = 0x80 | (byte & 0x3F);
+}
+
+/*
+ * escape_value
+ * return byte of escaped mbchar, -1 if not escaped
+ */
+int escape_value(const unsigned char *mbchar) {
+    if (mbchar[0] != 0xED || (mbchar[1] & 0xFC) != 0xB0)
+        return -1;
+    return ((mbchar[1] & 0x03) << 6) | (mbchar[2] & 0x3F);
+}
+
+/*
+ * utf8_put
+ * return bytes of code point
+ */
+unsigned int utf8_put(uint32_t code, unsigned char *out) {
+    if (code < 0x80) {
+        out[0] = code;
+        return 1;
+    }
+    if (code < 0x800) {
+        out[0] = 0xC0 | (code >> 6);
+        out[1] = 0x80 | (code & 0x3F);
+        return 2;
+    }
+    if (code < 0x10000) {
+        out[0] = 0xE0 | (code >> 12);
+        out[1] = 0x80 | ((code >> 6) & 0x3F);
+        out[2] = 0x80 | (code & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (code >> 18);
+    out[1] = 0x80 | ((code >> 12) & 0x3F);
+    out[2] = 0x80 | ((code >> 6) & 0x3F);
+    out[3] = 0x80 | (code & 0x3F);
+    return 4;
+}
+
+/*
+ * utf8_get
+ * code point of mbchar of size bytes
+ */
+uint32_t utf8_get(const unsigned char *mbchar, unsigned int size) {
+    if (size == 1)
+        return mbchar[0];
+    uint32_t code = mbchar[0] & (0x7F >> size);
+    unsigned int i;
+    for (i = 1; i < size; i++)
+        code = (code << 6) | (mbchar[i] & 0x3F);
+    return code;
+}
+
+/*
+ * encoding_name
+ * for header
+ */
+const char *encoding_name(enum Encoding encoding) {
+    switch (encoding) {
+    case ENCODING_SJIS:
+        return "Shift_JIS";
+    case ENCODING_EUCJP:
+        return "EUC-JP";
+    case ENCODING_UTF16LE:
+        return "UTF-16LE";
+    case ENCODING_UTF16BE:
+        return "UTF-16BE";
+    default:
+        return "UTF-8";
+    }
+}
+
+/*
+ * encoding_from_name
+ * ENCODING_AUTO if unknown
+ */
+enum Encoding encoding_from_name(const char *name) {
+    if (strcasecmp(name, "utf-8") == 0 || strcasecmp(name, "utf8") == 0)
+        return ENCODING_UTF8;
+    if (strcasecmp(name, "shift_jis") == 0 || strcasecmp(name, "sjis") == 0 || strcasecmp(name, "cp932") == 0)
+        return ENCODING_SJIS;
+    if (strcasecmp(name, "euc-jp") == 0 || strcasecmp(name, "eucjp") == 0)
+        return ENCODING_EUCJP;
+    if (strcasecmp(name, "utf-16le") == 0)
+        return ENCODING_UTF16LE;
+    if (strcasecmp(name, "utf-16be") == 0 || strcasecmp(name, "utf-16") == 0)
+        return ENCODING_UTF16BE;
+    return ENCODING_AUTO;
+}
+
+/*
+ * encoding_detect
+ * BOM, then zero bytes of UTF-16, then which of utf-8, Shift_JIS, EUC-JP has least errors
+ */
+enum Encoding encoding_detect(const unsigned char *bytes, size_t size, int *has_bom) {
+    *has_bom = 0;
+    if (size >= 3 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF) {
+        *has_bom = 1;
+        return ENCODING_UTF8;
+    }
+    if (size >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE) {
+        *has_bom = 1;
+        return ENCODING_UTF16LE;
+    }
+    if (size >= 2 && bytes[0] == 0xFE && bytes[1] == 0xFF) {
+        *has_bom = 1;
+        return ENCODING_UTF16BE;
+    }
+    size_t i;
+    size_t even_zero = 0, odd_zero = 0;
+    for (i = 0; i < size; i++)
+        if (bytes[i] == 0 && i % 2)
+            odd_zero++;
+        else if (bytes[i] == 0)
+            even_zero++;
+    // ascii in UTF-16 has zero in every other byte
+    if (size >= 4 && odd_zero > size / 4 && even_zero < odd_zero / 8)
+        return ENCODING_UTF16LE;
+    if (size >= 4 && even_zero > size / 4 && odd_zero < even_zero / 8)
+        return ENCODING_UTF16BE;
+
+    size_t utf8_errors = 0, sjis_errors = 0, euc_errors = 0;
+    // kana rows are most common in japanese text
+    size_t sjis_kana = 0, euc_kana = 0;
+    size_t non_ascii = 0;
+    for (i = 0; i < size; i++) {
+        unsigned char b = bytes[i];
+        if (b < 0x80)
+            continue;
+        non_ascii++;
+        unsigned int length = b >= 0xF0 ? 4 : b >= 0xE0 ? 3 : b >= 0xC2 ? 2 : 0;
+        unsigned int k;
+        for (k = 1; k < length && i + k < size; k++)
+            if ((bytes[i + k] & 0xC0) != 0x80)
+                break;
+        if (length == 0 || b > 0xF4 || (k < length && i + k < size))
+            utf8_errors++;
+        else
+            i += k - 1;
+    }
+    if (non_ascii == 0 || utf8_errors == 0)
+        return ENCODING_UTF8;
+    for (i = 0; i < size; i++) {
+        unsigned char b = bytes[i];
+        if (b < 0x80)
+            continue;
+        if ((b >= 0x81 && b <= 0x9F) || (b >= 0xE0 && b <= 0xFC)) {
+            if (i + 1 < size) {
+                unsigned char t = bytes[i + 1];
+                if (t < 0x40 || t == 0x7F || t > 0xFC)
+                    sjis_errors++;
+                else if (b == 0x82 || b == 0x83)
+                    sjis_kana++;
+                i++;
+            }
+        } else if (b < 0xA1 || b > 0xDF) {
+            sjis_errors++;
+        }
+    }
+    for (i = 0; i < size; i++) {
+        unsigned char b = bytes[i];
+        if (b < 0x80)
+            continue;
+        unsigned int length = b == 0x8F ? 3 : (b == 0x8E || (b >= 0xA1 && b <= 0xFE)) ? 2 : 0;
+        if (length == 0) {
+            euc_errors++;
+            continue;
+        }
+        unsigned int k;
+        for (k = 1; k < length && i + k < size; k++)
+            if (bytes[i + k] < 0xA1 || bytes[i + k] > 0xFE)
+                break;
+        if (k < length && i + k < size)
+            euc_errors++;
+        else if (b == 0xA4 || b == 0xA5)
+            euc_kana++;
+        i += k - 1;
+    }
+    if (utf8_errors < sjis_errors && utf8_errors < euc_errors)
+        return ENCODING_UTF8;
+    if (sjis_errors != euc_errors)
+        return sjis_errors < euc_errors ? ENCODING_SJIS : ENCODING_EUCJP;
+    return sjis_kana > euc_kana ? ENCODING_SJIS : ENCODING_EUCJP;
+}
+
+/*
+ * code_table_bytes
+ * bytes of code of table, return 0 if it is not a char
+ */
+unsigned int code_table_bytes(enum Encoding encoding, uint32_t code, unsigned char *bytes) {
+    unsigned char lead = code >> 8;
+    unsigned char trail = code & 0xFF;
+    if (encoding == ENCODING_SJIS) {
+        if (code < 0x100) {
+            bytes[0] = code;
+            return (code >= 0x01 && code <= 0x7F) || (code >= 0xA1 && code <= 0xDF);
+        }
+        if (!((lead >= 0x81 && lead <= 0x9F) || (lead >= 0xE0 && lead <= 0xFC)) || trail < 0x40 || trail == 0x7F || trail > 0xFC)
+            return 0;
+        bytes[0] = lead;
+        bytes[1] = trail;
+        return 2;
+    }
+    if (code >= 0x10000) {
+        if (lead < 0xA1 || lead > 0xFE || trail < 0xA1 || trail > 0xFE)
+            return 0;
+        bytes[0] = 0x8F;
+        bytes[1] = lead;
+        bytes[2] = trail;
+        return 3;
+    }
+    if (code < 0x100) {
+        bytes[0] = code;
+        return code >= 0x01 && code <= 0x7F;
+    }
+    if (lead == 0x8E ? (trail < 0xA1 || trail > 0xDF) : (lead < 0xA1 || lead > 0xFE || trail < 0xA1 || trail > 0xFE))
+        return 0;
+    bytes[0] = lead;
+    bytes[1] = trail;
+    return 2;
+}
+
+/*
+ * code_table_get
+ * tables are expanded from code_table.h at first use
+ */
+struct code_table *code_table_get(enum Encoding encoding) {
+    static struct code_table tables[2];
+    struct code_table *table = &tables[encoding == ENCODING_SJIS ? 0 : 1];
+    if (table->decode)
+        return table;
+    uint32_t count = encoding == ENCODING_SJIS ? 0x10000 : 0x20000;
+    table->decode = (uint32_t *)calloc(count, sizeof(uint32_t));
+    table->encode = (uint32_t *)calloc(0x10000, sizeof(uint32_t));
+    uint32_t code;
+    for (code = 0; code < count; code++) {
+        unsigned char bytes[3];
+        unsigned int length = code_table_bytes(encoding, code, bytes);
+        uint32_t point;
+        if (length == 0)
+            continue;
+        if (length == 1)
+            // ascii, half width kana of Shift_JIS
+            point = bytes[0] < 0x80 ? bytes[0] : 0xFF61 + bytes[0] - 0xA1;
+        else if (encoding == ENCODING_SJIS)
+            point = sjis_double_table[bytes[0] <= 0x9F ? bytes[0] - 0x81 : bytes[0] - 0xE0 + 31][bytes[1] - 0x40];
+        else if (length == 3)
+            point = eucjp_triple_table[bytes[1] - 0xA1][bytes[2] - 0xA1];
+        else if (bytes[0] == 0x8E)
+            point = 0xFF61 + bytes[1] - 0xA1;
+        else
+            point = eucjp_double_table[bytes[0] - 0xA1][bytes[1] - 0xA1];
+        if (point == 0)
+            continue;
+        table->decode[code] = point;
+        uint32_t packed = 0;
+        unsigned int i;
+        for (i = 0; i < length; i++)
+            packed = packed << 8 | bytes[i];
+        table->encode[point] = (uint32_t)length << 24 | packed;
+    }
+    return table;
+}
+
+/*
+ * transcoder_init
+ * BOM is skipped on decode and put on encode if has_bom
+ */
+void transcoder_init(struct transcoder *tc, enum Encoding encoding, int has_bom) {
+    tc->encoding = encoding;
+    tc->has_bom = has_bom;
+    tc->bom_left = !has_bom ? 0 : encoding == ENCODING_UTF8 ? 3 : 2;
+    tc->table = encoding == ENCODING_SJIS || encoding == ENCODING_EUCJP ? code_table_get(encoding) : NULL;
+    tc->pending_len = 0;
+    tc->escape_count = 0;
+}
+
+/*
+ * transcoder_decode_one
+ * one char at bytes to utf-8 at out + *out_size
+ * return bytes used, 0 if more bytes are needed
+ */
+size_t transcoder_decode_one(struct transcoder *tc, const unsigned char *bytes, size_t size, unsigned char *out, size_t *out_size) {
+    unsigned char b = bytes[0];
+    uint32_t point = 0;
+    size_t used = 1;
+    switch (tc->encoding) {
+    case ENCODING_SJIS:
+        if ((b >= 0x81 && b <= 0x9F) || (b >= 0xE0 && b <= 0xFC)) {
+            if (size < 2)
+                return 0;
+            point = tc->table->decode[b << 8 | bytes[1]];
+            used = point ? 2 : 1;
+        } else {
+            point = tc->table->decode[b];
+        }
+        break;
+    case ENCODING_EUCJP:
+        if (b == 0x8F) {
+            if (size < 3)
+                return 0;
+            point = tc->table->decode[0x10000 | bytes[1] << 8 | bytes[2]];
+            used = point ? 3 : 1;
+        } else if (b == 0x8E || (b >= 0xA1 && b <= 0xFE)) {
+            if (size < 2)
+                return 0;
+            point = tc->table->decode[b << 8 | bytes[1]];
+            used = point ? 2 : 1;
+        } else {
+            point = tc->table->decode[b];
+        }
+        break;
+    case ENCODING_UTF16LE:
+    case ENCODING_UTF16BE:
+        {
+        if (size < 2)
+            return 0;
+        int is_le = tc->encoding == ENCODING_UTF16LE;
+        uint32_t unit = is_le ? (bytes[0] | bytes[1] << 8) : (bytes[0] << 8 | bytes[1]);
+        used = 2;
+        if (unit >= 0xD800 && unit <= 0xDBFF) {
+            if (size < 4)
+                return 0;
+            uint32_t low = is_le ? (bytes[2] | bytes[3] << 8) : (bytes[2] << 8 | bytes[3]);
+            if (low >= 0xDC00 && low <= 0xDFFF) {
+                point = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+                used = 4;
+            }
+        } else if (unit < 0xDC00 || unit > 0xDFFF) {
+            point = unit;
+        }
+        }
+        break;
+    default:
+        break;
+    }
+    if (point) {
+        *out_size += utf8_put(point, &out[*out_size]);
+        return used;
+    }
+    // not decodable, bytes are kept
+    size_t i;
+    for (i = 0; i < used; i++) {
+        escape_byte(bytes[i], &out[*out_size]);
+        *out_size += 3;
+    }
+    tc->escape_count++;
+    return used;
+}
+
+/*
+ * transcoder_decode
+ * bytes of file to utf-8, out needs size * 3 + 16
+ * return size of out
+ */
+size_t transcoder_decode(struct transcoder *tc, const unsigned char *in, size_t size, unsigned char *out) {
+    size_t out_size = 0;
+    size_t i = 0;
+    if (tc->pending_len) {
+        // char divided by last block
+        unsigned char joined[8];
+        size_t head = tc->pending_len;
+        size_t extra = size < 4 ? size : 4;
+        memcpy(joined, tc->pending, head);
+        memcpy(&joined[head], in, extra);
+        size_t pos = 0;
+        size_t used = 1;
+        while (pos < head && used) {
+            used = transcoder_decode_one(tc, &joined[pos], head + extra - pos, out, &out_size);
+            pos += used;
+        }
+        if (pos < head) {
+            // in is too short
+            memmove(tc->pending, &joined[pos], head + extra - pos);
+            tc->pending_len = head + extra - pos;
+            return out_size;
+        }
+        i = pos - head;
+        tc->pending_len = 0;
+    }
+    while (i < size) {
+        size_t used = transcoder_decode_one(tc, &in[i], size - i, out, &out_size);
+        if (!used)
+            break;
+        i += used;
+    }
+    memcpy(tc->pending, &in[i], size - i);
+    tc->pending_len = size - i;
+    return out_size;
+}
+
+/*
+ * transcoder_flush
+ * escape bytes of char not completed at end of file
+ */
+size_t transcoder_flush(struct transcoder *tc, unsigned char *out) {
+    size_t out_size = 0;
+    unsigned int i;
+    for (i = 0; i < tc->pending_len; i++) {
+        escape_byte(tc->pending[i], &out[out_size]);
+        out_size += 3;
+    }
+    tc->escape_count += tc->pending_len;
+    tc->pending_len = 0;
+    return out_size;
+}
+
+/*
+ * transcoder_encode
+ * utf-8 of text to bytes of file, in has whole chars, out needs size * 2 + 4
+ * char not in encoding is written as ?
+ * return size of out
+ */
+size_t transcoder_encode(struct transcoder *tc, const unsigned char *in, size_t size, unsigned char *out) {
+    size_t o = 0;
+    size_t i = 0;
+    if (tc->bom_left) {
+        if (tc->encoding == ENCODING_UTF8) {
+            out[o++] = 0xEF;
+            out[o++] = 0xBB;
+            out[o++] = 0xBF;
+        } else {
+            out[o++] = tc->encoding == ENCODING_UTF16LE ? 0xFF : 0xFE;
+            out[o++] = tc->encoding == ENCODING_UTF16LE ? 0xFE : 0xFF;
+        }
+        tc->bom_left = 0;
+    }
+    while (i < size) {
+        unsigned int length = safed_mbchar_size((mbchar)&in[i]);
+        if (length > 4 || i + length > size) {
+            out[o++] = in[i++];
+            continue;
+        }
+        int escaped = length == 3 ? escape_value(&in[i]) : -1;
+        uint32_t point = utf8_get(&in[i], length);
+        if (escaped >= 0) {
+            out[o++] = escaped;
+        } else if (tc->encoding == ENCODING_UTF8) {
+            memcpy(&out[o], &in[i], length);
+            o += length;
+        } else if (tc->encoding == ENCODING_UTF16LE || tc->encoding == ENCODING_UTF16BE) {
+            uint32_t units[2];
+            unsigned int count = 1;
+            units[0] = point;
+            if (point >= 0x10000) {
+                units[0] = 0xD800 + ((point - 0x10000) >> 10);
+                units[1] = 0xDC00 + ((point - 0x10000) & 0x3FF);
+                count = 2;
+            }
+            unsigned int k;
+            for (k = 0; k < count; k++) {
+                out[o++] = tc->encoding == ENCODING_UTF16LE ? units[k] & 0xFF : units[k] >> 8;
+                out[o++] = tc->encoding == ENCODING_UTF16LE ? units[k] >> 8 : units[k] & 0xFF;
+            }
+        } else {
+            uint32_t packed = point < 0x10000 ? tc->table->encode[point] : 0;
+            if (point < 0x80) {
+                out[o++] = point;
+            } else if (packed == 0) {
+                out[o++] = '?';
+                tc->escape_count++;
+            } else {
+                unsigned int k = packed >> 24;
+                while (k--)
+                    out[o++] = packed >> (8 * k);
+            }
+        }
+        i += length;
+    }
+    return o;
+}
+
+/*
+ * file_read
+ * read filename to struct string
+ */
+struct text *file_read(const char *filename, struct file_state *state) {
+	FILE* fp;
+	
+	if ((fp = fopen(filename, "r")) == NULL) {
+		fprintf(stderr, "file open error\n");
+		exit(EXIT_FAILURE);
+	}
+
+    if (state) {
+        struct stat st;
+        fstat(fileno(fp), &st);
+        state->dev = st.st_dev;
+        state->ino = st.st_ino;
+        state->size = st.st_size;
+        state->mtime = st.st_mtim;
+        block_hash_init(&state->head_hash, 0);
+        block_hash_init(&state->tail_hash, st.st_size % FILE_HASH_BLOCK);
+        state->is_tail_valid = 1;
+        state->is_indexed = 0;
+        size_t map_size;
+        struct index_header *header = state->encoding == ENCODING_AUTO || state->encoding == ENCODING_UTF8
+            ? index_cache_map(filename, &st, &map_size) : NULL;
+        if (header) {
+            struct text *head = file_read_indexed(fp, header, state);
+            munmap(header, map_size);
+            if (head) {
+                fclose(fp);
+                return head;
+            }
+            // file is changed with same size and mtime, read again
+            rewind(fp);
+            block_hash_free(&state->head_hash);
+            block_hash_free(&state->tail_hash);
+            block_hash_init(&state->tail_hash, st.st_size % FILE_HASH_BLOCK);
+        }
+    }
+    struct text_decoder decoder;
+    text_decoder_init(&decoder);
+    struct transcoder tc;
+    unsigned char *block = (unsigned char *)malloc(READ_BLOCK_SIZE);
+    size_t size;
+    int is_first = 1;
+    while ((size = fread(block, 1, READ_BLOCK_SIZE, fp)) > 0) {
+        if (is_first) {
+            // encoding is detected by first block
+            int has_bom;
+            enum Encoding encoding = encoding_detect(block, size, &has_bom);
+            if (state && state->encoding != ENCODING_AUTO && state->encoding != encoding)
+                has_bom = 0;
+            if (state && state->encoding != ENCODING_AUTO)
+                encoding = state->encoding;
+            transcoder_init(&tc, encoding, has_bom);
+            if (state) {
+                state->encoding = encoding;
+                state->has_bom = has_bom;
+            }
+            is_first = 0;
+        }
+        text_decoder_feed_file(&decoder, &tc, block, size);
+        if (state) {
+            block_hash_feed(&state->head_hash, block, size);
+            block_hash_feed(&state->tail_hash, block, size);
+        }
+    }
+    if (!is_first)
+        text_decoder_finish(&decoder, &tc);
+    else if (state && state->encoding == ENCODING_AUTO)
+        // empty file
+        state->encoding = ENCODING_UTF8;
+    free(block);
+    fclose(fp);
+    return decoder.head;
+}
+
+/*
+ * index_row_apply
+ * set cached counts to text
+ */
+void index_row_apply(struct text *text, struct index_row *row) {
+    text->byte_count = row->byte_count;
+    text->position_count = row->position_count;
+    text->width_count = row->width_count;
+}
+
+/*
+ * file_read_indexed
+ * cut bytes to rows by cached byte counts without decode and width count, file is plain utf-8
+ * bytes are still read for hash and copied to lines
+ * return NULL if file is not same as cache
+ */
+struct text *file_read_indexed(FILE *fp, struct index_header *header, struct file_state *state) {
+    struct index_row *rows = (struct index_row *)(header + 1);
+    struct text *head = text_malloc();
+    struct text *text = head;
+    struct line *line = head->line;
+    line->position_count = 0;
+    unum y = 0;
+    unum rest = rows[0].byte_count;
+    unum position = 0;
+    unsigned char last_byte = 0;
+    int is_same = 1;
+    unsigned char *block = (unsigned char *)malloc(READ_BLOCK_SIZE);
+    size_t size;
+    while (is_same && (size = fread(block, 1, READ_BLOCK_SIZE, fp)) > 0) {
+        block_hash_feed(&state->head_hash, block, size);
+        block_hash_feed(&state->tail_hash, block, size);
+        size_t i;
+        for (i = 0; i < size; i++) {
+            if (rest == 0) {
+                // row ends by \n, except last one
+                if (y + 1 >= header->row_count || last_byte != '\n' || rows[y].byte_count == 0 || position != rows[y].position_count) {
+                    is_same = 0;
+                    break;
+                }
+                index_row_apply(text, &rows[y]);
+                text = text_insert(text);
+                line = text->line;
+                line->position_count = 0;
+                rest = rows[++y].byte_count;
+                position = 0;
+            }
+            unsigned char c = block[i];
+            // continuation byte goes with head byte
+            unsigned int char_size = (c & 0xC0) == 0x80 ? 1 : c < 0x80 ? 1 : c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+            if (line->byte_count + char_size > BUFFER_SIZE - 1) {
+                line = line_insert(line);
+                line->position_count = 0;
+            }
+            line->string[line->byte_count++] = c;
+            if ((c & 0xC0) != 0x80) {
+                line->position_count++;
+                position++;
+            }
+            last_byte = c;
+            rest--;
+        }
+    }
+    free(block);
+    // empty tail row after \n has no byte to start it
+    if (is_same && rest == 0 && last_byte == '\n' && y + 1 < header->row_count) {
+        if (rows[y].byte_count == 0 || position != rows[y].position_count) {
+            is_same = 0;
+        } else {
+            index_row_apply(text, &rows[y]);
+            text = text_insert(text);
+            text->line->position_count = 0;
+            rest = rows[++y].byte_count;
+            position = 0;
+        }
+    }
+    // tail row has no \n
+    if (is_same && rest == 0 && y + 1 == header->row_count && position == rows[y].position_count
+        && block_hash_digest(&state->head_hash) == header->hash) {
+        index_row_apply(text, &rows[y]);
+        state->encoding = ENCODING_UTF8;
+        state->has_bom = 0;
+        state->is_indexed = 1;
+        return head;
+    }
+    text_list_free(head);
+    return NULL;
+}
+
+/*
+ * index_cache_path
+ * cache file of absolute path of filename, under XDG_CACHE_HOME or ~/.cache
+ * return NULL if there is no place
+ */
+char *index_cache_path(const char *filename, int is_mkdir) {
+    char *path = realpath(filename, NULL);
+    if (!path)
+        return NULL;
+    unum hash = FNV_OFFSET_BASIS;
+    char *c;
+    for (c = path; *c; c++)
+        hash = (hash ^ (unsigned char)*c) * FNV_PRIME;
+    free(path);
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dirname[4096];
+    if (base && base[0])
+        snprintf(dirname, sizeof(dirname), "%s", base);
+    else if (home && home[0])
+        snprintf(dirname, sizeof(dirname), "%s/.cache", home);
+    else
+        return NULL;
+    if (is_mkdir)
+        mkdir(dirname, 0700);
+    strncat(dirname, "/console_editor", sizeof(dirname) - strlen(dirname) - 1);
+    if (is_mkdir)
+        mkdir(dirname, 0700);
+    char *cache_path = (char *)malloc(strlen(dirname) + 32);
+    sprintf(cache_path, "%s/%016llx.idx", dirname, hash);
+    return cache_path;
+}
+
+/*
+ * index_cache_map
+ * map cache of filename if it is for the file of st
+ * return NULL if there is no cache or it is old
+ */
+struct index_header *index_cache_map(const char *filename, struct stat *st, size_t *map_size) {
+    if (st->st_size < INDEX_CACHE_MIN_BYTES)
+        return NULL;
+    char *cache_path = index_cache_path(filename, 0);
+    if (!cache_path)
+        return NULL;
+    int fd = open(cache_path, O_RDONLY);
+    free(cache_path);
+    if (fd == -1)
+        return NULL;
+    struct stat cache_st;
+    fstat(fd, &cache_st);
+    struct index_header *header = NULL;
+    if ((size_t)cache_st.st_size >= sizeof(struct index_header))
+        header = (struct index_header *)mmap(NULL, cache_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (header == MAP_FAILED)
+        header = NULL;
+    if (header && (header->magic != INDEX_CACHE_MAGIC || header->row_size != sizeof(struct index_row)
+            || header->size != (uint64_t)st->st_size || header->dev != (uint64_t)st->st_dev || header->ino != (uint64_t)st->st_ino
+            || header->mtime_sec != st->st_mtim.tv_sec || header->mtime_nsec != st->st_mtim.tv_nsec
+            || header->row_count == 0
+            || (uint64_t)cache_st.st_size != sizeof(struct index_header) + header->row_count * sizeof(struct index_row))) {
+        munmap(header, cache_st.st_size);
+        header = NULL;
+    }
+    if (header)
+        // used recently, for eviction
+        futimens(fd, NULL);
+    close(fd);
+    *map_size = cache_st.st_size;
+    return header;
+}
+
+/*
+ * index_cache_store
+ * write row metadata of text which is same as file, replaced by rename
+ */
+void index_cache_store(const char *filename, struct text *head, struct file_state *state) {
+    if (!state->is_exact || state->size < INDEX_CACHE_MIN_BYTES)
+        return;
+    unum row_count = 0;
+    struct text *text;
+    for (text = head; text; text = text->next) {
+        if (text->byte_count > UINT32_MAX)
+            return;
+        row_count++;
+    }
+    unum cache_size = sizeof(struct index_header) + row_count * sizeof(struct index_row);
+    // one file should not take whole budget
+    if (cache_size > INDEX_CACHE_BUDGET / 4)
+        return;
+    char *cache_path = index_cache_path(filename, 1);
+    if (!cache_path)
+        return;
+    char *temp_path = (char *)malloc(strlen(cache_path) + 16);
+    sprintf(temp_path, "%s.%d", cache_path, (int)getpid());
+    FILE *fp = fopen(temp_path, "w");
+    if (fp) {
+        struct index_header header;
+        memset(&header, 0, sizeof(header));
+        header.magic = INDEX_CACHE_MAGIC;
+        header.row_size = sizeof(struct index_row);
+        header.size = state->size;
+        header.mtime_sec = state->mtime.tv_sec;
+        header.mtime_nsec = state->mtime.tv_nsec;
+        header.dev = state->dev;
+        header.ino = state->ino;
+        header.hash = block_hash_digest(&state->head_hash);
+        header.row_count = row_count;
+        fwrite(&header, sizeof(header), 1, fp);
+        for (text = head; text; text = text->next) {
+            struct index_row row;
+            row.byte_count = text->byte_count;
+            row.position_count = text->position_count;
+            row.width_count = text->width_count;
+            fwrite(&row, sizeof(row), 1, fp);
+        }
+        if (fclose(fp) == 0 && rename(temp_path, cache_path) == 0) {
+            *strrchr(cache_path, '/') = '\0';
+            index_cache_evict(cache_path, INDEX_CACHE_BUDGET);
+        } else {
+            unlink(temp_path);
+        }
+    }
+    free(temp_path);
+    free(cache_path);
+}
+
+/*
+ * index_cache_update
+ * rewrite rows from from_y of cache written for file of old_size and old_mtime
+ * rows above are same as file, return 0 if there is no such cache
+ */
+int index_cache_update(const char *filename, struct text *from, unum from_y, unum row_count, struct file_state *state,
+        off_t old_size, struct timespec old_mtime) {
+    if (!state->is_exact || state->size < INDEX_CACHE_MIN_BYTES)
+        return 0;
+    unum cache_size = sizeof(struct index_header) + row_count * sizeof(struct index_row);
+    if (cache_size > INDEX_CACHE_BUDGET / 4)
+        return 0;
+    char *cache_path = index_cache_path(filename, 0);
+    if (!cache_path)
+        return 0;
+    int fd = open(cache_path, O_RDWR);
+    free(cache_path);
+    if (fd == -1)
+        return 0;
+    struct index_header header;
+    struct stat cache_st;
+    fstat(fd, &cache_st);
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != INDEX_CACHE_MAGIC
+            || header.row_size != sizeof(struct index_row) || header.size != (uint64_t)old_size
+            || header.dev != (uint64_t)state->dev || header.ino != (uint64_t)state->ino
+            || header.mtime_sec != old_mtime.tv_sec || header.mtime_nsec != old_mtime.tv_nsec
+            || header.row_count < from_y - 1
+            || (uint64_t)cache_st.st_size != sizeof(struct index_header) + header.row_count * sizeof(struct index_row)) {
+        close(fd);
+        return 0;
+    }
+    struct index_row rows[1024];
+    unsigned int count = 0;
+    off_t offset = sizeof(struct index_header) + (from_y - 1) * sizeof(struct index_row);
+    int is_written = 1;
+    for (; from && is_written; from = from->next) {
+        rows[count].byte_count = from->byte_count;
+        rows[count].position_count = from->position_count;
+        rows[count].width_count = from->width_count;
+        if (from->byte_count > UINT32_MAX)
+            is_written = 0;
+        if (++count == sizeof(rows) / sizeof(rows[0]) || !from->next) {
+            is_written = is_written && pwrite(fd, rows, sizeof(rows[0]) * count, offset) == (ssize_t)(sizeof(rows[0]) * count);
+            offset += sizeof(rows[0]) * count;
+            count = 0;
+        }
+    }
+    // header is put last, rows of half written cache don't match its size
+    header.size = state->size;
+    header.mtime_sec = state->mtime.tv_sec;
+    header.mtime_nsec = state->mtime.tv_nsec;
+    header.hash = block_hash_digest(&state->head_hash);
+    header.row_count = row_count;
+    is_written = is_written && ftruncate(fd, cache_size) == 0
+        && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+    if (!is_written)
+        ftruncate(fd, 0);
+    close(fd);
+    return is_written;
+}
+
+/*
+ * index_cache_evict
+ * remove least recently used caches until total is in budget
+ */
+void index_cache_evict(const char *dirname, unum budget_bytes) {
+    DIR *dir = opendir(dirname);
+    if (!dir)
+        return;
+    char path[4096];
+    while (1) {
+        unum total = 0;
+        char oldest[256] = "";
+        struct timespec oldest_time = {0, 0};
+        struct dirent *entry;
+        rewinddir(dir);
+        while ((entry = readdir(dir))) {
+            size_t length = strlen(entry->d_name);
+            if (length < 4 || strcmp(entry->d_name + length - 4, ".idx") != 0)
+                continue;
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name);
+            if (stat(path, &st) == -1)
+                continue;
+            total += st.st_size;
+            if (!oldest[0] || st.st_mtim.tv_sec < oldest_time.tv_sec
+                    || (st.st_mtim.tv_sec == oldest_time.tv_sec && st.st_mtim.tv_nsec < oldest_time.tv_nsec)) {
+                snprintf(oldest, sizeof(oldest), "%s", entry->d_name);
+                oldest_time = st.st_mtim;
+            }
+        }
+        if (total <= budget_bytes || !oldest[0])
+            break;
+        snprintf(path, sizeof(path), "%s/%s", dirname, oldest);
+        if (unlink(path) == -1)
+            break;
+    }
+    closedir(dir);
+}
+
+/*
+ * file_write_bytes
+ * encode bytes of text and write, written bytes are hashed
+ * return written size
+ */
+unum file_write_bytes(FILE *fp, struct file_state *state, struct transcoder *tc, const unsigned char *bytes, size_t size, unsigned char *out) {
+    if (tc->encoding == ENCODING_UTF8 && !tc->bom_left && !memchr(bytes, 0xED, size)) {
+        // no escape, as it is
+        fwrite(bytes, 1, size, fp);
+        if (state) {
+            block_hash_feed(&state->head_hash, bytes, size);
+            block_hash_feed(&state->tail_hash, bytes, size);
+        }
+        return size;
+    }
+    unum written = 0;
+    while (size) {
+        size_t slice = size < TRANSCODE_SLICE ? size : TRANSCODE_SLICE;
+        // whole chars in slice
+        while (slice < size && (bytes[slice] & 0xC0) == 0x80 && slice < TRANSCODE_SLICE + UTF8_MAX_BYTE)
+            slice++;
+        size_t out_size = transcoder_encode(tc, bytes, slice, out);
+        fwrite(out, 1, out_size, fp);
+        if (state) {
+            block_hash_feed(&state->head_hash, out, out_size);
+            block_hash_feed(&state->tail_hash, out, out_size);
+        }
+        written += out_size;
+        bytes += slice;
+        size -= slice;
+    }
+    return written;
+}
+
+/*
+ * file_write
+ * write file from head in encoding of state
+ * return count of chars which are not in the encoding
+ */
+unum file_write(const char* filepath, struct text *head, struct file_state *state) {
+    FILE *fp;
+    if ((fp = fopen(filepath, "w")) == NULL) {
+        printf("[error]can't open file\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (state) {
+        // hash what is written, instead of read again
+        block_hash_free(&state->head_hash);
+        block_hash_free(&state->tail_hash);
+        block_hash_init(&state->head_hash, 0);
+        block_hash_init(&state->tail_hash, text_total_bytes(head) % FILE_HASH_BLOCK);
+    }
+    struct transcoder tc;
+    transcoder_init(&tc, state ? state->encoding : ENCODING_UTF8, state ? state->has_bom : 0);
+    unsigned char *out = (unsigned char *)malloc((TRANSCODE_SLICE + UTF8_MAX_BYTE) * 2 + 4);
+    unum total = 0;
+    unum written = 0;
+    struct text *current_text = head;
+	struct line *current_line = head->line;
+    while (current_text) {
+        if (current_text->cold) {
+            // without thaw
+            written += file_write_bytes(fp, state, &tc, cold_row_bytes(current_text), current_text->byte_count, out);
+        }
+        current_line = current_text->line;
+        while (current_line) {
+            written += file_write_bytes(fp, state, &tc, current_line->string, current_line->byte_count, out);
+            current_line = current_line->next;
+        }
+        total += current_text->byte_count;
+        current_text = current_text->next;
+    }
+    free(out);
+	fclose(fp);
+    if (state) {
+        struct stat st;
+        stat(filepath, &st);
+        state->dev = st.st_dev;
+        state->ino = st.st_ino;
+        state->size = st.st_size;
+        state->mtime = st.st_mtim;
+        // offset of row is offset in file only if nothing is converted
+        state->is_exact = written == total && state->encoding == ENCODING_UTF8 && !state->has_bom;
+        // tail hash is aligned by size of text
+        state->is_tail_valid = written == total;
+        state->is_modified = 0;
+        state->is_save_confirmed = 0;
+        state->follow_len = 0;
+        state->dirty_y = 0;
+    }
+    return tc.escape_count;
+}
+
+/*
+ * file_write_tail
+ * write rows from text at dirty_offset and cut rest of file, rows above are not written
+ * return written size, -1 if file can't be opened
+ */
+long long file_write_tail(const char* filepath, struct text *text, struct file_state *state) {
+    FILE *fp;
+    if ((fp = fopen(filepath, "r+")) == NULL)
+        return -1;
+    unum offset = state->dirty_offset;
+    // hash of blocks before offset are kept, head of last block is read again
+    unum start = block_hash_truncate(&state->head_hash, offset);
+    unsigned char *out = (unsigned char *)malloc(FILE_HASH_BLOCK > (TRANSCODE_SLICE + UTF8_MAX_BYTE) * 2 + 4
+        ? FILE_HASH_BLOCK : (TRANSCODE_SLICE + UTF8_MAX_BYTE) * 2 + 4);
+    fseeko(fp, start, SEEK_SET);
+    if (fread(out, 1, offset - start, fp) != offset - start) {
+        free(out);
+        fclose(fp);
+        return -1;
+    }
+    block_hash_feed(&state->head_hash, out, offset - start);
+    // tail blocks are aligned by new size, not known yet
+    block_hash_free(&state->tail_hash);
+    fseeko(fp, offset, SEEK_SET);
+    struct transcoder tc;
+    transcoder_init(&tc, ENCODING_UTF8, 0);
+    unum total = 0;
+    unum written = 0;
+    while (text) {
+        if (text->cold)
+            written += file_write_bytes(fp, state, &tc, cold_row_bytes(text), text->byte_count, out);
+        struct line *line = text->line;
+        while (line) {
+            written += file_write_bytes(fp, state, &tc, line->string, line->byte_count, out);
+            line = line->next;
+        }
+        total += text->byte_count;
+        text = text->next;
+    }
+    free(out);
+    fflush(fp);
+    ftruncate(fileno(fp), offset + written);
+    struct stat st;
+    fstat(fileno(fp), &st);
+    fclose(fp);
+    block_hash_free(&state->tail_hash);
+    state->size = st.st_size;
+    state->mtime = st.st_mtim;
+    // escaped bytes are written as 1 byte
+    state->is_exact = written == total;
+    state->is_tail_valid = 0;
+    state->is_modified = 0;
+    state->is_save_confirmed = 0;
+    state->follow_len = 0;
+    state->dirty_y = 0;
+    return written;
+}
+
+/*
+ * file_state_mark_dirty
+ * lower dirty_y to position_y, offset is counted from nearer end or last dirty row
+ */
+void file_state_mark_dirty(struct context *context, unum position_y) {
+    struct file_state *state = &context->file_state;
+    if (!state->is_exact || (state->dirty_y && state->dirty_y <= position_y))
+        return;
+    unum count = context_row_count(context);
+    if (position_y > count)
+        position_y = count;
+    unum offset = 0;
+    unum y;
+    if (state->dirty_y) {
+        // rows between are not changed yet
+        offset = state->dirty_offset;
+        for (y = position_y; y < state->dirty_y; y++)
+            offset -= context_text_at(context, y)->byte_count;
+    } else if (position_y <= count / 2) {
+        for (y = 1; y < position_y; y++)
+            offset += context_text_at(context, y)->byte_count;
+    } else {
+        // text is same as file without undecoded rest of follow
+        offset = state->size - state->follow_len;
+        for (y = position_y; y <= count; y++)
+            offset -= context_text_at(context, y)->byte_count;
+    }
+    state->dirty_y = position_y;
+    state->dirty_offset = offset;
+}
+
+/*
+ * context_read_file
+ * store contents of filename to the members of struct context
+ */
+void context_read_file(struct context *context, char *filename) {
+    context->filename = (char *)malloc(strlen(filename) + 1);
+    strcpy(context->filename, filename);
+    context->file_state.is_indexed = 0;
+    context->file_state.is_index_stale = 0;
+    context->text = file_read(context->filename, &context->file_state);
+    if (!context->file_state.is_indexed)
+        calculation_width(context->text, 0);
+    // illegal bytes are escaped to 3 bytes, other encodings are converted
+    context->file_state.is_exact = text_total_bytes(context->text) == (unum)context->file_state.size
+        && context->file_state.encoding == ENCODING_UTF8 && !context->file_state.has_bom;
+    context->file_state.is_modified = 0;
+    context->file_state.is_save_confirmed = 0;
+    context->file_state.follow_len = 0;
+    context->file_state.dirty_y = 0;
+    context->file_state.is_reload_pending = 0;
+    if (!context->file_state.is_indexed)
+        index_cache_store(context->filename, context->text, &context->file_state);
+    context->file_state.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    context->file_state.watch = -1;
+    file_state_watch(context);
+}
+
+/*
+ * text_total_bytes
+ * sum of byte_count of rows
+ */
+unum text_total_bytes(struct text *head) {
+    unum total = 0;
+    while (head) {
+        total += head->byte_count;
+        head = head->next;
+    }
+    return total;
+}
+
+/*
+ * block_hash_init
+ * phase is first block size, 0 is same as FILE_HASH_BLOCK
+ */
+void block_hash_init(struct block_hash *hash, unum phase) {
+    hash->phase = phase;
+    hash->offset = 0;
+    hash->hashes = NULL;
+    hash->count = 0;
+    hash->capacity = 0;
+}
+
+/*
+ * block_hash_feed
+ * continue hash of bytes after hash->offset
+ */
+void block_hash_feed(struct block_hash *hash, const unsigned char *bytes, size_t size) {
+    while (size > 0) {
+        unum next_boundary;
+        if (hash->offset < hash->phase)
+            next_boundary = hash->phase;
+        else
+            next_boundary = hash->phase + ((hash->offset - hash->phase) / FILE_HASH_BLOCK + 1) * FILE_HASH_BLOCK;
+        int is_boundary = hash->offset == hash->phase
+            || (hash->offset > hash->phase && (hash->offset - hash->phase) % FILE_HASH_BLOCK == 0);
+        if (hash->count == 0 || (hash->offset > 0 && is_boundary)) {
+            if (hash->count == hash->capacity) {
+                hash->capacity = hash->capacity ? hash->capacity * 2 : 64;
+                hash->hashes = (unum *)realloc(hash->hashes, sizeof(unum) * hash->capacity);
+            }
+            hash->hashes[hash->count++] = FNV_OFFSET_BASIS;
+        }
+        unum n = next_boundary - hash->offset;
+        if (n > size)
+            n = size;
+        unum h = hash->hashes[hash->count - 1];
+        unum i;
+        for (i = 0; i < n; i++)
+            h = (h ^ bytes[i]) * FNV_PRIME;
+        hash->hashes[hash->count - 1] = h;
+        hash->offset += n;
+        bytes += n;
+        size -= n;
+    }
+}
+
+/*
+ * block_hash_truncate
+ * drop hashes from block including offset, return head of the block to feed again
+ */
+unum block_hash_truncate(struct block_hash *hash, unum offset) {
+    unum count;
+    unum start;
+    if (hash->phase == 0) {
+        count = offset / FILE_HASH_BLOCK;
+        start = count * FILE_HASH_BLOCK;
+    } else if (offset < hash->phase) {
+        count = 0;
+        start = 0;
+    } else {
+        count = (offset - hash->phase) / FILE_HASH_BLOCK + 1;
+        start = hash->phase + (count - 1) * FILE_HASH_BLOCK;
+    }
+    if (count < hash->count)
+        hash->count = count;
+    hash->offset = start;
+    return start;
+}
+
+/*
+ * block_hash_digest
+ * one hash of all blocks
+ */
+unum block_hash_digest(struct block_hash *hash) {
+    unum digest = FNV_OFFSET_BASIS;
+    unum i;
+    for (i = 0; i < hash->count; i++)
+        digest = (digest ^ hash->hashes[i]) * FNV_PRIME;
+    return digest;
+}
+
+/*
+ * block_hash_free
+ * free hashes
+ */
+void block_hash_free(struct block_hash *hash) {
+    free(hash->hashes);
+    block_hash_init(hash, 0);
+}
+
+/*
+ * file_state_watch
+ * watch filename by inotify, again after file is replaced
+ */
+void file_state_watch(struct context *context) {
+    struct file_state *state = &context->file_state;
+    if (state->inotify_fd == -1)
+        return;
+    if (state->watch != -1)
+        inotify_rm_watch(state->inotify_fd, state->watch);
+    state->watch = inotify_add_watch(state->inotify_fd, context->filename,
+        IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+/*
+ * file_state_is_changed
+ * compare stat with last read or saved
+ */
+int file_state_is_changed(struct context *context, struct stat *st) {
+    struct file_state *state = &context->file_state;
+    if (stat(context->filename, st) == -1)
+        return 0;
+    return st->st_dev != state->dev || st->st_ino != state->ino || st->st_size != state->size
+        || st->st_mtim.tv_sec != state->mtime.tv_sec || st->st_mtim.tv_nsec != state->mtime.tv_nsec;
 }
 
 /*
- * string_width
- * return string display width
+ * file_watch_handle
+ * read inotify events and follow or reload
+ * return 1 if text is changed
  */
-unum string_width(unsigned char *message) {
-    unsigned int width = 0;
-    long max_byte = strlen((char *)message);
-    unsigned int i = 0;
-    while(i < max_byte) {
-        width += mbchar_width(&message[i]);
-        i += safed_mbchar_size(&message[i]);
+int file_watch_handle(struct context *context) {
+    struct file_state *state = &context->file_state;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    uint32_t mask = 0;
+    ssize_t size;
+    while ((size = read(state->inotify_fd, events, sizeof(events))) > 0) {
+        char *p = events;
+        while (p < events + size) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            mask |= event->mask;
+            p += sizeof(struct inotify_event) + event->len;
+        }
     }
-    return width;
+    struct stat st;
+    if (mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED | IN_ATTRIB))
+        // maybe replaced by rename
+        file_state_watch(context);
+    if (!file_state_is_changed(context, &st)) {
+        state->is_reload_pending = 0;
+        return 0;
+    }
+    if (state->is_modified) {
+        snprintf((char *)context->message, sizeof(context->message), "file is changed on disk, Ctrl+S twice to override");
+        return 1;
+    }
+    int is_same_file = st.st_dev == state->dev && st.st_ino == state->ino;
+    if (state->is_follow && is_same_file && st.st_size >= state->size && state->is_exact)
+        return file_follow_append(context, &st);
+    // writer keeping fd open like log is reloaded after short delay, not per write
+    if (is_same_file && !(mask & (IN_CLOSE_WRITE | IN_ATTRIB)) && file_watch_pending_ms(context) != 0) {
+        if (!state->is_reload_pending) {
+            state->is_reload_pending = 1;
+            clock_gettime(CLOCK_MONOTONIC, &state->modify_time);
+        }
+        return 0;
+    }
+    state->is_reload_pending = 0;
+    return file_reload_changed(context);
 }
 
 /*
- * console_size
- * return console size
+ * file_watch_pending_ms
+ * ms until reload of modified file, -1 if not pending
  */
-struct view_size console_size(void) {
-    struct view_size view_size;
-    view_size.width = 0;
-    view_size.height = 0;
-    
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) {
-        fprintf(stderr, "ioctl error\n");
-        exit(EXIT_FAILURE);
-    } else {
-        view_size.width = ws.ws_col;
-        view_size.height = ws.ws_row;
+int file_watch_pending_ms(struct context *context) {
+    struct file_state *state = &context->file_state;
+    if (!state->is_reload_pending)
+        return -1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long elapsed = (now.tv_sec - state->modify_time.tv_sec) * 1000LL + (now.tv_nsec - state->modify_time.tv_nsec) / 1000000;
+    return elapsed >= WATCH_DEBOUNCE_MS ? 0 : (int)(WATCH_DEBOUNCE_MS - elapsed);
+}
+
+/*
+ * file_follow_append
+ * read only bytes after last size, like tail -f
+ */
+int file_follow_append(struct context *context, struct stat *st) {
+    struct file_state *state = &context->file_state;
+    int fd = open(context->filename, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    unum last_y = context_row_count(context);
+    struct text *last = context_text_at(context, last_y);
+    int is_cursor_last = context->cursor.position_y == last_y;
+    clipboard_before_edit(context, last_y, last_y);
+    // continue from last row
+    struct text_decoder decoder;
+    last = text_thaw(context, last, last_y);
+    decoder.is_raw = 1;
+    decoder.escape_count = 0;
+    decoder.head = last;
+    decoder.current_text = last;
+    decoder.current_line = last->line;
+    while (decoder.current_line->next)
+        decoder.current_line = decoder.current_line->next;
+    memcpy(decoder.buf, state->follow_buf, UTF8_MAX_BYTE);
+    decoder.len = state->follow_len;
+
+    unsigned char *block = (unsigned char *)malloc(READ_BLOCK_SIZE);
+    off_t offset = state->size;
+    ssize_t size;
+    while (offset < st->st_size && (size = pread(fd, block, READ_BLOCK_SIZE, offset)) > 0) {
+        text_decoder_feed(&decoder, block, size);
+        block_hash_feed(&state->head_hash, block, size);
+        offset += size;
     }
-    return view_size;
+    free(block);
+    close(fd);
+    memcpy(state->follow_buf, decoder.buf, UTF8_MAX_BYTE);
+    state->follow_len = decoder.len;
+    if (decoder.escape_count)
+        state->is_exact = 0;
+    struct text *appended = last->next;
+    while (last) {
+        calculation_text_width(last);
+        if (is_cursor_last && last->next)
+            context->cursor.position_y++;
+        last = last->next;
+    }
+    // rows before are not moved
+    if (appended)
+        row_index_insert_rows(context, last_y + 1, appended, decoder.current_text);
+    state->is_tail_valid = 0;
+    state->size = offset;
+    state->mtime = st->st_mtim;
+    return 1;
 }
 
 /*
- * file_read
- * read filename to struct string
+ * file_reload_changed
+ * find changed range by block hash, read only rows of the range
+ * whole file is read again if not exact, converted or escaped text has no file offset
  */
-struct text *file_read(const char *filename) {
-	FILE* fp;
-	
-	if ((fp = fopen(filename, "r")) == NULL) {
-		fprintf(stderr, "file open error\n");
-		exit(EXIT_FAILURE);
-	}
+int file_reload_changed(struct context *context) {
+    struct file_state *state = &context->file_state;
+    int fd = open(context->filename, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    struct stat new_st;
+    fstat(fd, &new_st);
+    unum old_size = state->size;
+    unum new_size = new_st.st_size;
+    struct block_hash head_hash, tail_hash;
+    block_hash_init(&head_hash, 0);
+    block_hash_init(&tail_hash, new_size % FILE_HASH_BLOCK);
+    unsigned char *block = (unsigned char *)malloc(READ_BLOCK_SIZE);
+    unum offset = 0;
+    ssize_t size;
+    while (offset < new_size && (size = pread(fd, block, READ_BLOCK_SIZE, offset)) > 0) {
+        block_hash_feed(&head_hash, block, size);
+        block_hash_feed(&tail_hash, block, size);
+        offset += size;
+    }
+    new_size = offset;
 
-    struct text *head = text_malloc();
-    struct text *current_text = head;
-    struct line *current_line = head->line;
+    // equal full blocks from head and from tail
+    unum prefix = 0;
+    unum suffix = 0;
+    if (state->is_exact) {
+        unum i = 0;
+        while (i < old_size / FILE_HASH_BLOCK && i < new_size / FILE_HASH_BLOCK
+               && state->head_hash.hashes[i] == head_hash.hashes[i])
+            i++;
+        prefix = i * FILE_HASH_BLOCK;
+        if (state->is_tail_valid) {
+            unum old_first = state->tail_hash.phase ? 1 : 0;
+            unum new_first = tail_hash.phase ? 1 : 0;
+            unum j = 1;
+            while (state->tail_hash.count >= old_first + j && tail_hash.count >= new_first + j
+                   && state->tail_hash.hashes[state->tail_hash.count - j] == tail_hash.hashes[tail_hash.count - j])
+                j++;
+            suffix = (j - 1) * FILE_HASH_BLOCK;
+        }
+        unum shorter = old_size < new_size ? old_size : new_size;
+        if (prefix + suffix > shorter)
+            suffix = shorter - prefix;
+    }
+    unum old_end = old_size - suffix;
+    int was_exact = state->is_exact;
 
-	mbchar buf = mbchar_malloc();
-    unsigned char c;
-    mbcher_zero_clear(buf);
-    unsigned int len = 0;
-    int mbsize;
-    while (1) {
-        c = (unsigned char)fgetc(fp);
-        if (feof(fp))
-            break;
-        buf[len] = c;
-        mbsize = mbchar_size(buf, len + 1);
-        if (mbsize > 0) {
-            line_add_char(current_line, buf);
-            if (is_line_break(buf)) {
-                current_text = text_insert(current_text);
-                current_line = current_text->line;
-            }
-            mbcher_zero_clear(buf);
-            len = 0;
-        } else if (mbsize == MBCHAR_NOT_FILL) {
-            // not valid
-            len++;
-        } else {
-			mbcher_zero_clear(buf);
-		}
+    // rows from the one including prefix to the one including old_end
+    struct text *first = context->text;
+    unum first_y = 1;
+    unum first_offset = 0;
+    while (first->next && first_offset + first->byte_count <= prefix) {
+        first_offset += first->byte_count;
+        first = first->next;
+        first_y++;
     }
-    mbchar_free(buf);
-    fclose(fp);
-    return head;
+    struct text *last = first;
+    unum last_y = first_y;
+    unum last_end = first_offset + first->byte_count;
+    // offset of row is not known if not exact, whole file is read
+    while (last->next && (last_end <= old_end || !state->is_exact)) {
+        last = last->next;
+        last_y++;
+        last_end += last->byte_count;
+    }
+    clipboard_before_edit(context, first_y, last_y);
+    if (context->cold_store) {
+        context_thaw_rows(context, first_y, last_y);
+        first = context_text_at(context, first_y);
+        last = context_text_at(context, last_y);
+    }
+    // tail row is read to end of file
+    unum new_end = last->next ? last_end + new_size - old_size : new_size;
+
+    struct text_decoder decoder;
+    text_decoder_init(&decoder);
+    struct transcoder tc;
+    transcoder_init(&tc, state->encoding, 0);
+    offset = first_offset;
+    while (offset < new_end && (size = pread(fd, block, READ_BLOCK_SIZE, offset)) > 0) {
+        if (offset + size > new_end)
+            size = new_end - offset;
+        if (offset == 0) {
+            // BOM may be added or removed
+            int has_bom;
+            enum Encoding encoding = encoding_detect(block, size, &has_bom);
+            transcoder_init(&tc, state->encoding, has_bom && encoding == state->encoding);
+            state->has_bom = tc.has_bom;
+        }
+        text_decoder_feed_file(&decoder, &tc, block, size);
+        offset += size;
+    }
+    text_decoder_finish(&decoder, &tc);
+    free(block);
+    close(fd);
+    struct text *new_last = decoder.current_text;
+    if (last->next && new_last != decoder.head) {
+        // empty row after \n is not needed, next row follows
+        new_last = new_last->prev;
+        text_list_free(decoder.current_text);
+        new_last->next = NULL;
+    }
+    unum new_count = 0;
+    struct text *current = decoder.head;
+    while (current) {
+        calculation_text_width(current);
+        new_count++;
+        current = current->next;
+    }
+
+    // replace rows
+    struct text *before = first->prev;
+    struct text *after = last->next;
+    last->next = NULL;
+    first->prev = NULL;
+    text_list_free(first);
+    if (after && new_count == 1 && decoder.head->byte_count == 0) {
+        // rows are only removed
+        text_list_free(decoder.head);
+        new_count = 0;
+        decoder.head = after;
+        new_last = before;
+    }
+    decoder.head->prev = before;
+    if (before)
+        before->next = decoder.head;
+    else
+        context->text = decoder.head;
+    if (new_last)
+        new_last->next = after;
+    if (after)
+        after->prev = new_last;
+
+    row_index_invalidate(context);
+    unum old_count = last_y - first_y + 1;
+    if (context->cursor.position_y > last_y)
+        context->cursor.position_y = context->cursor.position_y + new_count - old_count;
+    if (context->render_start_height >= last_y)
+        context->render_start_height = context->render_start_height + new_count - old_count;
+    cursor_set_clear(context);
+    context->mark_active = 0;
+
+    block_hash_free(&state->head_hash);
+    block_hash_free(&state->tail_hash);
+    state->head_hash = head_hash;
+    state->tail_hash = tail_hash;
+    state->is_tail_valid = 1;
+    state->dev = new_st.st_dev;
+    state->ino = new_st.st_ino;
+    state->size = new_size;
+    state->mtime = new_st.st_mtim;
+    state->is_exact = text_total_bytes(context->text) == new_size && state->encoding == ENCODING_UTF8 && !state->has_bom;
+    state->follow_len = 0;
+    state->dirty_y = 0;
+    if (was_exact)
+        snprintf((char *)context->message, sizeof(context->message), "reloaded %llu rows changed on disk", new_count);
+    else
+        snprintf((char *)context->message, sizeof(context->message), "reloaded whole file, %llu rows", new_count);
+    vailidate_cursor_position(context);
+    return 1;
 }
 
 /*
- * file_write
- * write file from head
+ * context_read_stream
+ * stdin is pipe, keyboard is taken from /dev/tty
  */
-void file_write(const char* filepath, struct text *head) {
-    FILE *fp;
-    if ((fp = fopen(filepath, "w")) == NULL) {
-        printf("[error]can't open file\n");
+void context_read_stream(struct context *context, unum budget_bytes) {
+    int fd = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+    if (fd == -1 || tty == -1) {
+        fprintf(stderr, "tty open error\n");
         exit(EXIT_FAILURE);
     }
-    
-    struct text *current_text = head;
-	struct line *current_line = head->line;
-    unum i;
-    while (current_text) {
-        current_line = current_text->line;
-        while (current_line) {
-            i = 0;
-            while (i < current_line->byte_count) {
-                fputc(current_line->string[i], fp);
-                i++;
+    dup2(tty, STDIN_FILENO);
+    close(tty);
+    context->filename = (char *)malloc(2);
+    strcpy(context->filename, "-");
+    context->text = text_malloc();
+    calculation_text_width(context->text);
+    context->stream = stream_start(fd, budget_bytes);
+    context->file_state.inotify_fd = -1;
+    context->file_state.is_reload_pending = 0;
+    context->file_state.is_modified = 0;
+    // stdin is not detected, bad bytes are escaped
+    context->file_state.encoding = ENCODING_UTF8;
+    context->file_state.has_bom = 0;
+    context->file_state.is_exact = 0;
+    context->file_state.dirty_y = 0;
+}
+
+/*
+ * stream_start
+ * run stream_reader thread
+ */
+struct stream *stream_start(int fd, unum budget_bytes) {
+    struct stream *stream = (struct stream *)malloc(sizeof(struct stream));
+    stream->fd = fd;
+    pthread_mutex_init(&stream->mutex, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    stream->batch_head = NULL;
+    stream->batch_tail = NULL;
+    stream->pending_bytes = 0;
+    stream->read_bytes = 0;
+    stream->budget_bytes = budget_bytes;
+    stream->is_eof = 0;
+    stream->is_truncated = 0;
+    pthread_create(&stream->thread, NULL, stream_reader, stream);
+    return stream;
+}
+
+/*
+ * stream_push
+ * give batch to main thread, wait while too much is pending
+ */
+void stream_push(struct stream *stream, struct stream_batch *batch) {
+    pthread_mutex_lock(&stream->mutex);
+    if (stream->batch_tail)
+        stream->batch_tail->next = batch;
+    else
+        stream->batch_head = batch;
+    stream->batch_tail = batch;
+    stream->pending_bytes += batch->bytes;
+    while (stream->pending_bytes >= STREAM_PENDING_BUDGET)
+        pthread_cond_wait(&stream->cond, &stream->mutex);
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+/*
+ * stream_reader
+ * thread, decode rows apart from document and push completed rows
+ * budget is hard cap of input, pipe is closed there and rest is dropped
+ */
+void *stream_reader(void *arg) {
+    struct stream *stream = (struct stream *)arg;
+    struct text_decoder decoder;
+    text_decoder_init(&decoder);
+    unsigned char *block = (unsigned char *)malloc(READ_BLOCK_SIZE);
+    unum batch_bytes = 0;
+    ssize_t size;
+    while (1) {
+        pthread_mutex_lock(&stream->mutex);
+        unum rest = stream->budget_bytes - stream->read_bytes;
+        if (rest == 0)
+            stream->is_truncated = 1;
+        pthread_mutex_unlock(&stream->mutex);
+        // writer gets EPIPE instead of waiting forever
+        if (rest == 0)
+            break;
+        size = read(stream->fd, block, rest < READ_BLOCK_SIZE ? rest : READ_BLOCK_SIZE);
+        if (size <= 0)
+            break;
+        text_decoder_feed(&decoder, block, size);
+        batch_bytes += size;
+        pthread_mutex_lock(&stream->mutex);
+        stream->read_bytes += size;
+        pthread_mutex_unlock(&stream->mutex);
+        if (decoder.current_text != decoder.head) {
+            struct stream_batch *batch = (struct stream_batch *)malloc(sizeof(struct stream_batch));
+            batch->head = decoder.head;
+            batch->tail = decoder.current_text->prev;
+            batch->tail->next = NULL;
+            batch->bytes = batch_bytes;
+            batch->is_final = 0;
+            batch->next = NULL;
+            decoder.current_text->prev = NULL;
+            decoder.head = decoder.current_text;
+            struct text *current = batch->head;
+            while (current) {
+                calculation_text_width(current);
+                current = current->next;
             }
-            current_line = current_line->next;
+            batch_bytes = 0;
+            stream_push(stream, batch);
         }
-        current_text = current_text->next;
     }
-	fclose(fp);
+    // broken sequence at end of input
+    text_decoder_finish(&decoder, NULL);
+    // rest row without \n
+    struct stream_batch *batch = (struct stream_batch *)malloc(sizeof(struct stream_batch));
+    calculation_text_width(decoder.head);
+    batch->head = decoder.head;
+    batch->tail = decoder.head;
+    batch->bytes = batch_bytes;
+    batch->is_final = 1;
+    batch->next = NULL;
+    free(block);
+    close(stream->fd);
+    stream_push(stream, batch);
+    return NULL;
 }
 
 /*
- * context_read_file
- * store contents of filename to the members of struct context
+ * stream_ingest
+ * link rows read until now before last row of document
+ * return number of batch
  */
-void context_read_file(struct context *context, char *filename) {
-    context->filename = (char *)malloc(sizeof(filename));
-    strcpy(context->filename, filename);
-    context->text = file_read(context->filename);
+int stream_ingest(struct context *context) {
+    struct stream *stream = context->stream;
+    pthread_mutex_lock(&stream->mutex);
+    struct stream_batch *batch = stream->batch_head;
+    stream->batch_head = NULL;
+    stream->batch_tail = NULL;
+    stream->pending_bytes = 0;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+
+    int count = 0;
+    // index is kept, rows are only put before tail
+    unum tail_y = batch ? context_row_count(context) : 0;
+    struct text *tail = batch ? context_text_at(context, tail_y) : NULL;
+    if (batch)
+        clipboard_before_edit(context, tail_y, tail_y);
+    while (batch) {
+        struct stream_batch *next = batch->next;
+        if (batch->is_final) {
+            // last row is joined to head of document tail
+            tail = text_thaw(context, tail, tail_y);
+            line_append(&batch->head->line, tail->line);
+            tail->line = batch->head->line;
+            free(batch->head);
+            text_drop_empty_line(tail);
+            calculation_text_width(tail);
+            stream->is_eof = 1;
+        } else {
+            batch->tail->next = tail;
+            batch->head->prev = tail->prev;
+            if (tail->prev)
+                tail->prev->next = batch->head;
+            else
+                context->text = batch->head;
+            tail->prev = batch->tail;
+            row_index_insert_rows(context, tail_y, batch->head, batch->tail);
+            tail_y = context_row_count(context);
+        }
+        free(batch);
+        batch = next;
+        count++;
+    }
+    if (stream->is_eof) {
+        pthread_join(stream->thread, NULL);
+        pthread_mutex_destroy(&stream->mutex);
+        pthread_cond_destroy(&stream->cond);
+        snprintf((char *)context->message, sizeof(context->message), "stdin: %llu bytes, %s", stream->read_bytes,
+            stream->is_truncated ? "stopped at budget" : "end of input");
+        free(stream);
+        context->stream = NULL;
+    }
+    return count;
 }
 
 /*
@@ -635,14 +4349,53 @@ void context_read_file(struct context *context, char *filename) {
  * call file_write
  */
 void context_write_override_file(struct context *context) {
-    file_write(context->filename, context->text);
+    if (strcmp(context->filename, "-") == 0) {
+        snprintf((char *)context->message, sizeof(context->message), "stdin can't be saved");
+        return;
+    }
+    struct file_state *state = &context->file_state;
+    struct stat st;
+    int is_changed = file_state_is_changed(context, &st);
+    if (is_changed && !state->is_save_confirmed) {
+        // don't clobber change of other process silently
+        state->is_save_confirmed = 1;
+        snprintf((char *)context->message, sizeof(context->message), "file is changed on disk, Ctrl+S again to override");
+        return;
+    }
+    if (!is_changed && state->is_exact && !state->is_modified) {
+        snprintf((char *)context->message, sizeof(context->message), "saved, no change");
+        return;
+    }
+    // rows above dirty_y are already in file
+    if (!is_changed && state->is_exact && state->dirty_y) {
+        unum offset = state->dirty_offset;
+        unum dirty_y = state->dirty_y;
+        off_t old_size = state->size;
+        struct timespec old_mtime = state->mtime;
+        struct text *dirty = context_text_at(context, dirty_y);
+        long long written = file_write_tail(context->filename, dirty, state);
+        if (written >= 0) {
+            snprintf((char *)context->message, sizeof(context->message), "saved from offset %llu, %lld bytes written", offset, written);
+            // only rows written to file are written to cache
+            if (!index_cache_update(context->filename, dirty, dirty_y, context_row_count(context), state, old_size, old_mtime))
+                state->is_index_stale = 1;
+            return;
+        }
+    }
+    unum lost = file_write(context->filename, context->text, state);
+    // whole cache is not written per save
+    state->is_index_stale = 1;
+    if (lost)
+        snprintf((char *)context->message, sizeof(context->message), "%llu chars are not in %s, written as ?", lost, encoding_name(state->encoding));
+    else
+        snprintf((char *)context->message, sizeof(context->message), "saved whole file, %llu bytes written", (unum)state->size);
 }
 
 /*
- * get_single_byte_key
- * if is_init, make non_canon, read and put back
+ * term_raw
+ * if bool, make non_canon, else put back
  */
-unsigned char get_single_byte_key(void) {
+void term_raw(int bool) {
     static int is_init = 0;
     static struct termios term_org;
     static struct termios non_canon;
@@ -650,14 +4403,97 @@ unsigned char get_single_byte_key(void) {
         tcgetattr(STDIN_FILENO, &term_org);
         non_canon = term_org;
         cfmakeraw(&non_canon);
+        is_init = 1;
     }
+    tcsetattr(STDIN_FILENO, 0, bool ? &non_canon : &term_org);
+}
+
+/*
+ * get_single_byte_key
+ * read in non_canon and put back
+ */
+unsigned char get_single_byte_key(void) {
     unsigned char key;
-    tcsetattr(STDIN_FILENO, 0, &non_canon);
+    term_raw(1);
     key = getchar();
-    tcsetattr(STDIN_FILENO, 0, &term_org);
+    term_raw(0);
     return key;
 }
 
+/*
+ * keyboard_poll
+ * return 1 if key comes in timeout_ms, 2 if watch_fd
+ */
+int keyboard_poll(int timeout_ms, int watch_fd) {
+    struct pollfd pfd[2];
+    pfd[0].fd = STDIN_FILENO;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    // negative fd is ignored by poll
+    pfd[1].fd = watch_fd;
+    pfd[1].events = POLLIN;
+    pfd[1].revents = 0;
+    term_raw(1);
+    int ready = poll(pfd, 2, timeout_ms);
+    term_raw(0);
+    if (ready <= 0)
+        return 0;
+    return (pfd[0].revents ? 1 : 0) | (pfd[1].revents ? 2 : 0);
+}
+
+/*
+ * wait_input
+ * while waiting key, take stream rows or change of file and render
+ */
+void wait_input(struct context *context) {
+    struct cold_store *store = context->cold_store;
+    while (1) {
+        if (store && (store->sweep_version != context->version || store->sweep_cursor_y != context->cursor.position_y)) {
+            store->is_sweep_done = 0;
+            store->sweep_version = context->version;
+            store->sweep_cursor_y = context->cursor.position_y;
+        }
+        int timeout = context->stream ? STREAM_FRAME_MS : -1;
+        if (store && !store->is_sweep_done) {
+            // sweep in progress continues soon
+            int idle = store->sweep_y > 1 ? 0 : COLD_IDLE_MS;
+            if (timeout < 0 || timeout > idle)
+                timeout = idle;
+        }
+        if (!context->compaction.is_done) {
+            int idle = context->compaction.y ? 0 : COMPACT_IDLE_MS;
+            if (timeout < 0 || timeout > idle)
+                timeout = idle;
+        }
+        int pending = file_watch_pending_ms(context);
+        if (pending >= 0 && (timeout < 0 || timeout > pending))
+            timeout = pending;
+        int ready = keyboard_poll(timeout, context->file_state.inotify_fd);
+        if (ready & 1)
+            return;
+        if (!ready && !context->compaction.is_done) {
+            // merged before rows are compressed
+            context->compaction.is_done = compaction_sweep(context);
+            if (context->compaction.is_done && context->message[0]) {
+                render_setting(context);
+                render(context);
+            }
+        } else if (!ready && store && !store->is_sweep_done) {
+            store->is_sweep_done = cold_sweep(context);
+        }
+        int is_changed = 0;
+        if ((ready & 2) || file_watch_pending_ms(context) == 0)
+            is_changed |= file_watch_handle(context);
+        if (context->stream)
+            is_changed |= stream_ingest(context);
+        if (is_changed) {
+            context->version++;
+            render_setting(context);
+            render(context);
+        }
+    }
+}
+
 /*
  * color_cursor
  * if bool, change cursor pink
@@ -670,66 +4506,502 @@ void color_cursor(int bool) {
         printf("\e[m");
 }
 
+/*
+ * key_read_byte
+ * return -1 if nothing in timeout_ms, negative timeout waits forever
+ */
+int key_read_byte(int timeout_ms) {
+    if (timeout_ms >= 0 && !(keyboard_poll(timeout_ms, -1) & 1))
+        return -1;
+    return get_single_byte_key();
+}
+
 /*
  * keyboard_scan
- * store scan to arg out
+ * read one key, CSI (ESC [ n ; m final) and SS3 (ESC O final) are decoded by key_sequence_table
  */
-mbchar keyboard_scan(mbchar *out) {
-    mbcher_zero_clear(*out);
-    unsigned int i = 0;
-    while (mbchar_size(*out, i) < 0) {
-        *out[i] = get_single_byte_key();
-        i++;
-        if (mbchar_size(*out, i) == MBCHAR_ILLIEGAL) {
-            mbcher_zero_clear(*out);
+void keyboard_scan(struct key *key) {
+    key->code = KEY_CHAR;
+    key->modifier = 0;
+    mbcher_zero_clear(key->mbchar);
+    int c = key_read_byte(-1);
+    if (c == 0x1B) {
+        c = key_read_byte(ESCAPE_TIMEOUT_MS);
+        if (c == -1) {
+            key->code = KEY_ESCAPE;
+            return;
+        }
+        if (c != '[' && c != 'O') {
+            // ESC and char is alt
+            key->modifier = KEY_MOD_ALT;
+            key->mbchar[0] = c;
+            return;
+        }
+        unsigned int params[2] = {0, 0};
+        unsigned int param_count = 0;
+        int final;
+        while ((final = key_read_byte(ESCAPE_TIMEOUT_MS)) != -1) {
+            if (final >= '0' && final <= '9') {
+                if (param_count == 0)
+                    param_count = 1;
+                if (param_count <= 2)
+                    params[param_count - 1] = params[param_count - 1] * 10 + (final - '0');
+            } else if (final == ';') {
+                param_count++;
+            } else {
+                break;
+            }
         }
+        key->code = KEY_NONE;
+        if (final == -1)
+            return;
+        // ESC [ 1 ; 5 A is ctrl + up
+        if (param_count >= 2 && params[1] > 1)
+            key->modifier = params[1] - 1;
+        unsigned int i;
+        for (i = 0; i < sizeof(key_sequence_table) / sizeof(key_sequence_table[0]); i++) {
+            const struct key_sequence *sequence = &key_sequence_table[i];
+            if (sequence->final == final && (sequence->number == 0 || sequence->number == params[0])) {
+                key->code = sequence->code;
+                break;
+            }
+        }
+        return;
     }
-    return *out;
+    key->mbchar[0] = c;
+    unsigned int size = safed_mbchar_size(key->mbchar);
+    unsigned int i;
+    for (i = 1; i < size && i < UTF8_MAX_BYTE; i++)
+        key->mbchar[i] = key_read_byte(-1);
+    if (size > UTF8_MAX_BYTE || mbchar_size(key->mbchar, size) == MBCHAR_ILLIEGAL)
+        key->code = KEY_NONE;
 }
 
 /*
  * command_parse
  * return kind of arg key
  */
-struct command command_parse(mbchar key) {
-    static enum ControlKeyFlag flag = 0;
+struct command command_parse(struct key *key) {
     struct command cmd;
     cmd.command_key = NONE;
-    cmd.command_value = key;
-    if (key[0] == 0x1B && flag == NOT_CTRL)
-        flag = ALLOW_1;
-    else if (key[0] == 0x5B && flag == ALLOW_1)
-        flag = ALLOW_2;
-    else if (flag == ALLOW_2) {
-        if (key[0] == 0x41)
-            cmd.command_key = UP;
-        else if (key[0] == 0x42)
-            cmd.command_key = DOWN;
-        else if (key[0] == 0x43)
-            cmd.command_key = RIGHT;
-        else if (key[0] == 0x44)
-            cmd.command_key = LEFT;
-        flag = NOT_CTRL;
-    } else {
-        if (key[0] == 0x11)
+    cmd.command_value = key->mbchar;
+    int is_ctrl = key->modifier & KEY_MOD_CTRL;
+    switch (key->code) {
+    case KEY_UP:
+        cmd.command_key = UP;
+        break;
+    case KEY_DOWN:
+        cmd.command_key = DOWN;
+        break;
+    case KEY_RIGHT:
+        cmd.command_key = is_ctrl ? WORD_RIGHT : RIGHT;
+        break;
+    case KEY_LEFT:
+        cmd.command_key = is_ctrl ? WORD_LEFT : LEFT;
+        break;
+    case KEY_HOME:
+        cmd.command_key = is_ctrl ? TOP : HOME;
+        break;
+    case KEY_END:
+        cmd.command_key = is_ctrl ? BOTTOM : END;
+        break;
+    case KEY_PAGE_UP:
+        cmd.command_key = PAGE_UP;
+        break;
+    case KEY_PAGE_DOWN:
+        cmd.command_key = PAGE_DOWN;
+        break;
+    case KEY_ESCAPE:
+        cmd.command_key = ESCAPE;
+        break;
+    case KEY_CHAR:
+        {
+        unsigned char c = key->mbchar[0];
+        if (key->modifier & KEY_MOD_ALT) {
+            // emacs like word move
+            if (c == 'f')
+                cmd.command_key = WORD_RIGHT;
+            else if (c == 'b')
+                cmd.command_key = WORD_LEFT;
+            else if (c == '<')
+                cmd.command_key = TOP;
+            else if (c == '>')
+                cmd.command_key = BOTTOM;
+            else if (c == '|')
+                cmd.command_key = TRANSFORM;
+        } else if (c == 0x11)
             cmd.command_key = EXIT;
-        else if (key[0] == 0x7F)
+        else if (c == 0x7F)
             cmd.command_key = DELETE;
-        else if (key[0] == 0x0D) {
+        else if (c == 0x0D) {
             cmd.command_key = ENTER;
             cmd.command_value = (mbchar)"\n";
         }
-        else if (key[0] == 0x20) {
-            cmd.command_key = INSERT;
-            cmd.command_value=(mbchar)" ";
+        else if (c == 0x13)
+            cmd.command_key = SAVE_OVERRIDE;
+        else if (c == 0x12)
+            cmd.command_key = MEMORY_REPORT;
+        else if (c == 0x00)
+            cmd.command_key = MARK;
+        else if (c == 0x18)
+            cmd.command_key = CUT;
+        else if (c == 0x03)
+            cmd.command_key = COPY;
+        else if (c == 0x16)
+            cmd.command_key = PASTE;
+        else if (c == 0x14)
+            cmd.command_key = RECTANGLE;
+        else if (c == 0x06)
+            cmd.command_key = FOLLOW;
+        else if (c == 0x07)
+            cmd.command_key = GOTO;
+        else if (c == 0x0B)
+            cmd.command_key = MACRO_RECORD;
+        else if (c == 0x10)
+            cmd.command_key = MACRO_PLAY;
+        else if (c == 0x01)
+            cmd.command_key = HOME;
+        else if (c == 0x05)
+            cmd.command_key = END;
+        else
+            cmd.command_key = INSERT;
+        }
+        break;
+    default:
+        break;
+    }
+    return cmd;
+}
+
+/*
+ * prompt_read
+ * read string in footer until enter
+ * return 0 if canceled by ESC or Ctrl+C
+ */
+int prompt_read(struct context *context, const char *label, unsigned char *out, unsigned int size) {
+    unsigned int len = 0;
+    out[0] = '\0';
+    struct key key;
+    while (1) {
+        snprintf((char *)context->message, sizeof(context->message), "%s%s", label, out);
+        render_setting(context);
+        render(context);
+        keyboard_scan(&key);
+        if (key.code == KEY_ESCAPE || (key.code == KEY_CHAR && key.mbchar[0] == 0x03)) {
+            context->message[0] = '\0';
+            return 0;
+        }
+        if (key.code != KEY_CHAR || key.modifier)
+            continue;
+        if (key.mbchar[0] == 0x0D)
+            break;
+        if (key.mbchar[0] == 0x7F) {
+            // back one mbchar
+            while (len > 0 && (out[--len] & 0xC0) == 0x80)
+                ;
+            out[len] = '\0';
+            continue;
+        }
+        if (key.mbchar[0] < 0x20)
+            continue;
+        unsigned int s = safed_mbchar_size(key.mbchar);
+        if (len + s + 1 > size)
+            continue;
+        memcpy(&out[len], key.mbchar, s);
+        len += s;
+        out[len] = '\0';
+    }
+    context->message[0] = '\0';
+    return 1;
+}
+
+/*
+ * text_max_position_x
+ * position just before \n, or after tail of last row
+ */
+unum text_max_position_x(struct text *text) {
+    if (text->next)
+        return text->position_count;
+    return text->position_count + 1;
+}
+
+/*
+ * cursor_compare_qsort
+ * wrapper of cursor_compare
+ */
+int cursor_compare_qsort(const void *a, const void *b) {
+    return cursor_compare(*(const struct cursor *)a, *(const struct cursor *)b);
+}
+
+/*
+ * cursor_set_add
+ * push cursor, call cursor_set_normalize after all added
+ */
+void cursor_set_add(struct context *context, struct cursor cursor) {
+    if (context->cursor_count == context->cursor_capacity) {
+        context->cursor_capacity = context->cursor_capacity ? context->cursor_capacity * 2 : 64;
+        context->cursors = (struct cursor *)realloc(context->cursors, sizeof(struct cursor) * context->cursor_capacity);
+    }
+    context->cursors[context->cursor_count++] = cursor;
+}
+
+/*
+ * cursor_set_normalize
+ * sort and remove same position
+ */
+void cursor_set_normalize(struct context *context) {
+    qsort(context->cursors, context->cursor_count, sizeof(struct cursor), cursor_compare_qsort);
+    unsigned int i, count = 0;
+    for (i = 0; i < context->cursor_count; i++) {
+        if (count == 0 || cursor_compare(context->cursors[count - 1], context->cursors[i]) != 0)
+            context->cursors[count++] = context->cursors[i];
+    }
+    context->cursor_count = count;
+    // only primary left
+    if (count == 1)
+        context->cursor_count = 0;
+}
+
+/*
+ * cursor_set_clear
+ * back to single cursor
+ */
+void cursor_set_clear(struct context *context) {
+    context->cursor_count = 0;
+}
+
+/*
+ * cursor_set_contains
+ * binary search, for render
+ */
+int cursor_set_contains(const struct context *context, struct cursor cursor) {
+    if (context->cursor_count == 0)
+        return cursor_compare(context->cursor, cursor) == 0;
+    return bsearch(&cursor, context->cursors, context->cursor_count, sizeof(struct cursor), cursor_compare_qsort) != NULL;
+}
+
+/*
+ * text_column_at
+ * display column of position_x, 1 origin
+ */
+unum text_column_at(struct text *text, unum position_x) {
+    unum column = 1;
+    unum pos = 1;
+    struct line *current_line = text->line;
+    // compressed row is read as one segment without thaw
+    unsigned char *segment = text->cold ? cold_row_bytes(text) : NULL;
+    unum segment_size = text->cold ? text->byte_count : 0;
+    while ((segment || current_line) && pos < position_x) {
+        if (!segment) {
+            segment = current_line->string;
+            segment_size = current_line->byte_count;
+            current_line = current_line->next;
+        }
+        unum i = 0;
+        while (i < segment_size && pos < position_x) {
+            column += mbchar_width(&segment[i]);
+            i += safed_mbchar_size(&segment[i]);
+            pos++;
+        }
+        segment = NULL;
+    }
+    return column;
+}
+
+/*
+ * text_position_at_column
+ * first position at or after display column, up to max position
+ */
+unum text_position_at_column(struct text *text, unum column) {
+    unum max_x = text_max_position_x(text);
+    unum current = 1;
+    unum pos = 1;
+    struct line *current_line = text->line;
+    while (current_line && current < column && pos < max_x) {
+        unsigned int i = 0;
+        while (i < current_line->byte_count && current < column && pos < max_x) {
+            current += mbchar_width(&current_line->string[i]);
+            i += safed_mbchar_size(&current_line->string[i]);
+            pos++;
+        }
+        current_line = current_line->next;
+    }
+    return pos;
+}
+
+/*
+ * rectangle_cursors
+ * select display columns between start and end on each row, cursor is put at left
+ * text is kept, delete or cut removes the columns explicitly
+ */
+void rectangle_cursors(struct context *context, struct cursor start, struct cursor end) {
+    unum top = start.position_y < end.position_y ? start.position_y : end.position_y;
+    unum bottom = start.position_y < end.position_y ? end.position_y : start.position_y;
+    context_thaw_rows(context, top, bottom);
+    // columns, not positions, so wide chars keep the edge straight
+    unum start_column = text_column_at(context_text_at(context, start.position_y), start.position_x);
+    unum end_column = text_column_at(context_text_at(context, end.position_y), end.position_x);
+    unum left = start_column < end_column ? start_column : end_column;
+    context->rectangle.top = top;
+    context->rectangle.bottom = bottom;
+    context->rectangle.left = left;
+    context->rectangle.right = start_column < end_column ? end_column : start_column;
+    struct text *current = context_text_at(context, top);
+    struct cursor cursor;
+    cursor_set_clear(context);
+    for (cursor.position_y = top; cursor.position_y <= bottom && current; cursor.position_y++) {
+        cursor.position_x = text_position_at_column(current, left);
+        cursor_set_add(context, cursor);
+        current = current->next;
+    }
+    cursor_set_normalize(context);
+    if (context->cursor_count)
+        context->cursor = context->cursors[context->cursor_count - 1];
+}
+
+/*
+ * rectangle_copy
+ * columns of rectangle as rows, document is only read
+ */
+struct clipboard rectangle_copy(struct context *context) {
+    struct rectangle *rectangle = &context->rectangle;
+    struct clipboard copy;
+    copy.head = NULL;
+    copy.tail = NULL;
+    copy.rows = NULL;
+    copy.row_count = 0;
+    copy.is_borrowed = 0;
+    unsigned char *bytes = NULL;
+    unum capacity = 0;
+    context_thaw_rows(context, rectangle->top, rectangle->bottom);
+    struct text *current = context_text_at(context, rectangle->top);
+    unum y;
+    for (y = rectangle->top; y <= rectangle->bottom && current; y++, current = current->next) {
+        unum from_x = text_position_at_column(current, rectangle->left);
+        unum to_x = text_position_at_column(current, rectangle->right);
+        if (capacity < current->byte_count + 2) {
+            capacity = current->byte_count + 2;
+            bytes = (unsigned char *)realloc(bytes, capacity);
+        }
+        unum size = text_copy_bytes(current, from_x, to_x, bytes);
+        if (y < rectangle->bottom && current->next)
+            bytes[size++] = '\n';
+        struct text *text = text_insert(copy.tail);
+        if (copy.head)
+            copy.row_count++;
+        else
+            copy.head = text;
+        copy.tail = text;
+        free(text->line);
+        text->line = line_from_bytes(bytes, size);
+        calculation_text_width(text);
+    }
+    free(bytes);
+    return copy;
+}
+
+/*
+ * rectangle_delete
+ * remove columns of rectangle, cursors are put at left of each row
+ */
+void rectangle_delete(struct context *context) {
+    struct rectangle *rectangle = &context->rectangle;
+    context_thaw_rows(context, rectangle->top, rectangle->bottom);
+    struct text *current = context_text_at(context, rectangle->top);
+    struct cursor cursor;
+    cursor_set_clear(context);
+    for (cursor.position_y = rectangle->top; cursor.position_y <= rectangle->bottom && current; cursor.position_y++) {
+        cursor.position_x = text_position_at_column(current, rectangle->left);
+        unum to_x = text_position_at_column(current, rectangle->right);
+        if (to_x > cursor.position_x) {
+            struct line *middle = line_cut(&current->line, cursor.position_x);
+            struct line *rest = line_cut(&middle, to_x - cursor.position_x + 1);
+            line_append(&current->line, rest);
+            line_list_free(middle);
+            text_drop_empty_line(current);
+            calculation_text_width(current);
+        }
+        cursor_set_add(context, cursor);
+        context->cursor = cursor;
+        current = current->next;
+    }
+    cursor_set_normalize(context);
+}
+
+/*
+ * command_perform_multi
+ * apply INSERT, DELETE, LEFT, RIGHT to all cursors
+ * one walk of rows, one width calculation per row
+ */
+void command_perform_multi(struct command command, struct context *context) {
+    struct cursor *cursors = context->cursors;
+    unsigned int count = context->cursor_count;
+    struct cursor *primary = bsearch(&context->cursor, cursors, count, sizeof(struct cursor), cursor_compare_qsort);
+    unsigned int primary_index = primary ? (unsigned int)(primary - cursors) : count - 1;
+    struct text *current = context_text_at(context, cursors[0].position_y);
+    unum current_y = cursors[0].position_y;
+    unsigned int first = 0;
+    while (first < count && current) {
+        unsigned int last = first;
+        while (last + 1 < count && cursors[last + 1].position_y == cursors[first].position_y)
+            last++;
+        while (current_y < cursors[first].position_y && current) {
+            current = current->next;
+            current_y++;
+        }
+        if (!current)
+            break;
+        current = text_thaw(context, current, current_y);
+        unum max_x = text_max_position_x(current);
+        unsigned int i;
+        unum shift;
+        switch (command.command_key) {
+        case INSERT:
+            // right to left, left positions are not moved by insert
+            for (i = last + 1; i-- > first;) {
+                unsigned int byte;
+                struct line *line = getLineAndByteFromPositionX(current->line, cursors[i].position_x, &byte);
+                if (line)
+                    insert_mbchar(line, byte, command.command_value);
+            }
+            for (i = first, shift = 1; i <= last; i++, shift++)
+                cursors[i].position_x += shift;
+            calculation_text_width(current);
+            break;
+        case DELETE:
+            // line is not combined in multi cursor
+            for (i = last + 1; i-- > first;) {
+                unsigned int byte;
+                if (cursors[i].position_x <= 1)
+                    continue;
+                struct line *line = getLineAndByteFromPositionX(current->line, cursors[i].position_x - 1, &byte);
+                if (line)
+                    delete_mbchar(line, byte);
+            }
+            for (i = first, shift = 0; i <= last; i++) {
+                if (cursors[i].position_x > 1)
+                    shift++;
+                cursors[i].position_x -= shift;
+            }
+            calculation_text_width(current);
+            break;
+        case LEFT:
+            for (i = first; i <= last; i++)
+                if (cursors[i].position_x > 1)
+                    cursors[i].position_x--;
+            break;
+        case RIGHT:
+            for (i = first; i <= last; i++)
+                if (cursors[i].position_x < max_x)
+                    cursors[i].position_x++;
+            break;
+        default:
+            break;
         }
-        else if (key[0] == 0x13)
-            cmd.command_key = SAVE_OVERRIDE;
-        else
-            cmd.command_key = INSERT;
-        flag = NOT_CTRL;
-    }        
-    return cmd;
+        first = last + 1;
+    }
+    context->cursor = cursors[primary_index];
+    cursor_set_normalize(context);
 }
 
 /*
@@ -741,10 +5013,10 @@ void vailidate_cursor_position(struct context *context) {
         context->cursor.position_x = 1;
     if (context->cursor.position_y < 1)
         context->cursor.position_y = 1;
-    while (!getTextFromPositionY(context->text, context->cursor.position_y))
-        context->cursor.position_y -= 1;
+    if (context->cursor.position_y > context_row_count(context))
+        context->cursor.position_y = context_row_count(context);
     
-    unum max_x = getTextFromPositionY(context->text, context->cursor.position_y)->position_count - 1;
+    unum max_x = text_max_position_x(context_text_at(context, context->cursor.position_y));
     if (context->cursor.position_x > max_x)
         context->cursor.position_x = max_x;
 }
@@ -755,6 +5027,74 @@ void vailidate_cursor_position(struct context *context) {
  * change state of arg context
  */
 void command_perform(struct command command, struct context *context) {
+    if (command.command_key != NONE)
+        context->message[0] = '\0';
+    switch (command.command_key) {
+    case INSERT:
+    case DELETE:
+    case ENTER:
+    case CUT:
+    case PASTE:
+        {
+        // lowest row can be changed, row above is joined by delete
+        unum y = context->cursor.position_y;
+        unum bottom = context->cursor.position_y;
+        if (context->mark_active && context->mark.position_y < y)
+            y = context->mark.position_y;
+        if (context->mark_active && context->mark.position_y > bottom)
+            bottom = context->mark.position_y;
+        if (context->cursor_count && context->cursors[0].position_y < y)
+            y = context->cursors[0].position_y;
+        if (context->cursor_count && context->cursors[context->cursor_count - 1].position_y > bottom)
+            bottom = context->cursors[context->cursor_count - 1].position_y;
+        file_state_mark_dirty(context, y > 1 ? y - 1 : 1);
+        // cut replaces clipboard, copied range is not cloned for it
+        struct cursor start, end;
+        if (command.command_key == CUT && (region_get(context, &start, &end) || context->rectangle.right > context->rectangle.left))
+            clipboard_free(&context->clipboard);
+        clipboard_before_edit(context, y > 1 ? y - 1 : 1, bottom + 1);
+        // edited chunks are merged in idle, rows after bottom are not touched
+        compaction_mark(context, y > 1 ? y - 1 : 1, bottom);
+        context->file_state.is_modified = 1;
+        context->version++;
+        }
+        break;
+    default:
+        break;
+    }
+    if (context->rectangle.right > context->rectangle.left) {
+        enum CommandType key = command.command_key;
+        if (key == CUT || key == COPY) {
+            clipboard_free(&context->clipboard);
+            context->clipboard = rectangle_copy(context);
+        }
+        // typed char replaces columns
+        if (key == INSERT || key == DELETE || key == CUT)
+            rectangle_delete(context);
+        if (key != NONE && key != MEMORY_REPORT && key != SAVE_OVERRIDE && key != FOLLOW) {
+            context->rectangle.left = 0;
+            context->rectangle.right = 0;
+        }
+        if (key == DELETE || key == CUT || key == COPY) {
+            vailidate_cursor_position(context);
+            return;
+        }
+    }
+    if (context->cursor_count) {
+        enum CommandType key = command.command_key;
+        if (key == INSERT || key == DELETE || key == LEFT || key == RIGHT) {
+            command_perform_multi(command, context);
+            return;
+        }
+        if (key != NONE && key != MEMORY_REPORT && key != SAVE_OVERRIDE && key != RECTANGLE && key != FOLLOW
+                && key != MACRO_RECORD && key != MACRO_PLAY)
+            cursor_set_clear(context);
+    }
+    if (command.command_key == INSERT || command.command_key == DELETE || command.command_key == ENTER) {
+        // joined rows too
+        unum y = context->cursor.position_y;
+        context_thaw_rows(context, y > 1 ? y - 1 : 1, y + 1);
+    }
     switch (command.command_key) {
     case UP:
         context->cursor.position_y -= 1;
@@ -769,14 +5109,24 @@ void command_perform(struct command command, struct context *context) {
         context->cursor.position_x -= 1;
         break;
     case EXIT:
+        if (context->file_state.is_index_stale && !context->file_state.is_modified)
+            index_cache_store(context->filename, context->text, &context->file_state);
+        // frame may be half printed, exit is after render thread ends
+        if (context->renderer) {
+            renderer_stop(context->renderer);
+            context->renderer = NULL;
+        }
+        fflush(stdout);
+        term_raw(0);
         exit(EXIT_SUCCESS);
         break;
     case INSERT:
         {
         unsigned int byte;
-        struct text *head = getTextFromPositionY(context->text, context->cursor.position_y);
+        struct text *head = context_text_at(context, context->cursor.position_y);
         struct line *line = getLineAndByteFromPositionX(head->line, context->cursor.position_x, &byte);
         insert_mbchar(line, byte, command.command_value);
+        calculation_text_width(head);
         context->cursor.position_x += 1;
         }
         break;
@@ -784,15 +5134,19 @@ void command_perform(struct command command, struct context *context) {
         {
         if (context->cursor.position_x > 1) {
             unsigned int byte;
-            struct text *head = getTextFromPositionY(context->text, context->cursor.position_y);
+            struct text *head = context_text_at(context, context->cursor.position_y);
             struct line *line = getLineAndByteFromPositionX(head->line, context->cursor.position_x - 1, &byte);
             delete_mbchar(line, byte);
+            calculation_text_width(head);
             context->cursor.position_x -= 1;
         } else if (context->cursor.position_y > 1) {
             // pos x is 1 and line is not top
-            struct text *head = getTextFromPositionY(context->text, context->cursor.position_y - 1);
+            struct text *head = context_text_at(context, context->cursor.position_y - 1);
             text_combine_next(head);
-            context->cursor.position_x = getTextFromPositionY(context->text, context->cursor.position_y - 1)->position_count;
+            row_index_remove(context, context->cursor.position_y);
+            // count before combined is new x
+            context->cursor.position_x = head->position_count;
+            calculation_text_width(head);
             context->cursor.position_y -= 1;
         }
         }
@@ -800,9 +5154,12 @@ void command_perform(struct command command, struct context *context) {
     case ENTER:
         {
         unsigned int byte;
-        struct text *head = getTextFromPositionY(context->text, context->cursor.position_y);
+        struct text *head = context_text_at(context, context->cursor.position_y);
         struct line *line = getLineAndByteFromPositionX(head->line, context->cursor.position_x, &byte);
         text_divide(head, line, byte, command.command_value);
+        row_index_insert(context, context->cursor.position_y + 1, head->next);
+        calculation_text_width(head);
+        calculation_text_width(head->next);
         context->cursor.position_x = 1;
         context->cursor.position_y += 1;
         }
@@ -810,44 +5167,743 @@ void command_perform(struct command command, struct context *context) {
     case SAVE_OVERRIDE:
         context_write_override_file(context);
         break;
+    case MEMORY_REPORT:
+        memory_report_format(memory_report_collect(context->text), context->message, sizeof(context->message));
+        break;
+    case MARK:
+        context->mark = context->cursor;
+        context->mark_active = !context->mark_active;
+        break;
+    case CUT:
+    case COPY:
+        {
+        struct cursor start, end;
+        if (region_get(context, &start, &end)) {
+            clipboard_free(&context->clipboard);
+            if (command.command_key == COPY) {
+                // document is not changed, range is cloned when it is pasted or edited
+                context->clipboard.is_borrowed = 1;
+                context->clipboard.is_tail_anchor = 0;
+                context->clipboard.start = start;
+                context->clipboard.end = end;
+            } else {
+                context->clipboard = region_cut(context, start, end);
+                context->cursor = start;
+            }
+            context->mark_active = 0;
+        }
+        }
+        break;
+    case PASTE:
+        if (context->clipboard.head || context->clipboard.is_borrowed) {
+            context->cursor = clipboard_paste(context, context->cursor);
+            context->mark_active = 0;
+        }
+        break;
+    case PAGE_UP:
+    case PAGE_DOWN:
+        {
+        // keep the row of cursor in view
+        unum page = context->body_height > 1 ? context->body_height - 1 : 1;
+        if (command.command_key == PAGE_UP) {
+            context->cursor.position_y = context->cursor.position_y > page ? context->cursor.position_y - page : 1;
+            context->render_start_height = context->render_start_height > page ? context->render_start_height - page : 0;
+        } else {
+            context->cursor.position_y += page;
+            context->render_start_height += page;
+            if (context->render_start_height + 1 > context_row_count(context))
+                context->render_start_height = context_row_count(context) - 1;
+        }
+        }
+        break;
+    case HOME:
+        context->cursor.position_x = 1;
+        break;
+    case END:
+        context->cursor.position_x = text_max_position_x(context_text_at(context, context->cursor.position_y));
+        break;
+    case TOP:
+        context->cursor.position_x = 1;
+        context->cursor.position_y = 1;
+        break;
+    case BOTTOM:
+        context->cursor.position_y = context_row_count(context);
+        context->cursor.position_x = text_max_position_x(context_text_at(context, context->cursor.position_y));
+        break;
+    case WORD_LEFT:
+    case WORD_RIGHT:
+        {
+        int direction = command.command_key == WORD_RIGHT ? 1 : -1;
+        struct text *text = text_thaw(context, context_text_at(context, context->cursor.position_y), context->cursor.position_y);
+        unum x = text_word_position(text, context->cursor.position_x, direction);
+        // go to next or previous row if no word
+        while (!x) {
+            if (direction > 0 && text->next) {
+                text = text_thaw(context, text->next, context->cursor.position_y + 1);
+                context->cursor.position_y++;
+                x = text_word_position(text, 0, direction);
+            } else if (direction < 0 && text->prev) {
+                text = text_thaw(context, text->prev, context->cursor.position_y - 1);
+                context->cursor.position_y--;
+                x = text_word_position(text, text->position_count + 1, direction);
+            } else {
+                x = direction > 0 ? text_max_position_x(text) : 1;
+            }
+        }
+        context->cursor.position_x = x;
+        }
+        break;
+    case GOTO:
+        {
+        // line number, or N% of rows
+        unsigned int len = strlen((char *)command.command_value);
+        unum value = strtoull((char *)command.command_value, NULL, 10);
+        if (len > 0 && command.command_value[len - 1] == '%')
+            value = context_row_count(context) * (value > 100 ? 100 : value) / 100;
+        context->cursor.position_y = value > 0 ? value : 1;
+        context->cursor.position_x = 1;
+        }
+        break;
+    case ESCAPE:
+        context->mark_active = 0;
+        break;
+    case TRANSFORM:
+        context_transform(context, command.command_value);
+        break;
+    case MACRO_RECORD:
+        if (context->macro.is_recording) {
+            context->macro.is_recording = 0;
+            snprintf((char *)context->message, sizeof(context->message), "macro recorded, %u commands", context->macro.count);
+        } else {
+            macro_clear(&context->macro);
+            context->macro.is_recording = 1;
+            snprintf((char *)context->message, sizeof(context->message), "recording macro, Ctrl+K to stop");
+        }
+        break;
+    case MACRO_PLAY:
+        if (context->macro.is_recording) {
+            snprintf((char *)context->message, sizeof(context->message), "macro is recording");
+        } else if (context->macro.count == 0) {
+            snprintf((char *)context->message, sizeof(context->message), "no macro");
+        } else {
+            unum times = macro_replay(context, command.command_value);
+            snprintf((char *)context->message, sizeof(context->message), "macro replayed %llu times", times);
+            // each command is validated already
+            return;
+        }
+        break;
+    case FOLLOW:
+        context->file_state.is_follow = !context->file_state.is_follow;
+        snprintf((char *)context->message, sizeof(context->message), "follow %s", context->file_state.is_follow ? "on" : "off");
+        break;
+    case RECTANGLE:
+        if (context->mark_active) {
+            rectangle_cursors(context, context->mark, context->cursor);
+            context->mark_active = 0;
+        } else {
+            // add cursor to next row
+            struct cursor next = context->cursor;
+            next.position_y++;
+            struct text *text = context_text_at(context, next.position_y);
+            if (text) {
+                if (next.position_x > text_max_position_x(text))
+                    next.position_x = text_max_position_x(text);
+                cursor_set_add(context, context->cursor);
+                cursor_set_add(context, next);
+                cursor_set_normalize(context);
+                context->cursor = next;
+            }
+        }
+        if (context->cursor_count)
+            return;
+        break;
     case NONE:
         break;
     }
-    calculation_width(context->text, context->view_size.width);
     vailidate_cursor_position(context);
 }
 
+/*
+ * macro_add
+ * copy command to tail of macro, commands for macro and file are not recorded
+ */
+void macro_add(struct macro *macro, struct command command) {
+    enum CommandType key = command.command_key;
+    if (key == NONE || key == MACRO_RECORD || key == MACRO_PLAY || key == EXIT || key == SAVE_OVERRIDE
+            || key == MEMORY_REPORT || key == FOLLOW)
+        return;
+    if (macro->count == macro->capacity) {
+        macro->capacity = macro->capacity ? macro->capacity * 2 : 16;
+        macro->commands = (struct command *)realloc(macro->commands, sizeof(struct command) * macro->capacity);
+    }
+    // value points buffer of key or prompt, it is overwritten by next key
+    unsigned int size = key == GOTO || key == TRANSFORM ? strlen((char *)command.command_value) + 1 : safed_mbchar_size(command.command_value);
+    mbchar value = (mbchar)malloc(size > UTF8_MAX_BYTE ? size : UTF8_MAX_BYTE);
+    memset(value, 0, size > UTF8_MAX_BYTE ? size : UTF8_MAX_BYTE);
+    memcpy(value, command.command_value, size);
+    command.command_value = value;
+    macro->commands[macro->count++] = command;
+}
+
+/*
+ * macro_clear
+ * free recorded commands
+ */
+void macro_clear(struct macro *macro) {
+    unsigned int i;
+    for (i = 0; i < macro->count; i++)
+        free(macro->commands[i].command_value);
+    macro->count = 0;
+}
+
+/*
+ * macro_replay
+ * perform macro times_text times, or until cursor stops at last row if empty
+ * nothing is rendered between commands
+ * return replayed times
+ */
+unum macro_replay(struct context *context, unsigned char *times_text) {
+    unum times = strtoull((char *)times_text, NULL, 10);
+    int is_to_end = times_text[0] == '\0';
+    unum done = 0;
+    while (is_to_end || done < times) {
+        struct cursor before = context->cursor;
+        unsigned int i;
+        for (i = 0; i < context->macro.count; i++)
+            command_perform(context->macro.commands[i], context);
+        done++;
+        // no progress would loop forever
+        if (is_to_end && (context->cursor.position_y >= context_row_count(context)
+                || cursor_compare(context->cursor, before) <= 0))
+            break;
+    }
+    return done;
+}
+
+/*
+ * transform_parse
+ * "sort -rniu", "uniq", "trim", "keep RE", "drop RE" or "reverse"
+ * return 0 with error message if illegal
+ */
+int transform_parse(struct transform *transform, unsigned char *text, unsigned char *error, unsigned int error_size) {
+    char *p = (char *)text;
+    while (*p == ' ')
+        p++;
+    char *name = p;
+    while (*p && *p != ' ')
+        p++;
+    unsigned int name_len = p - name;
+    while (*p == ' ')
+        p++;
+    transform->is_reverse = 0;
+    transform->is_numeric = 0;
+    transform->is_fold = 0;
+    transform->is_unique = 0;
+    if (name_len == 4 && strncmp(name, "sort", 4) == 0) {
+        transform->type = TRANSFORM_SORT;
+        for (; *p; p++) {
+            if (*p == 'r')
+                transform->is_reverse = 1;
+            else if (*p == 'n')
+                transform->is_numeric = 1;
+            else if (*p == 'i')
+                transform->is_fold = 1;
+            else if (*p == 'u')
+                transform->is_unique = 1;
+            else if (*p != '-' && *p != ' ') {
+                snprintf((char *)error, error_size, "unknown sort option %c", *p);
+                return 0;
+            }
+        }
+    } else if (name_len == 4 && strncmp(name, "uniq", 4) == 0) {
+        transform->type = TRANSFORM_UNIQ;
+    } else if (name_len == 4 && strncmp(name, "trim", 4) == 0) {
+        transform->type = TRANSFORM_TRIM;
+    } else if (name_len == 7 && strncmp(name, "reverse", 7) == 0) {
+        transform->type = TRANSFORM_REVERSE;
+    } else if (name_len == 4 && (strncmp(name, "keep", 4) == 0 || strncmp(name, "drop", 4) == 0)) {
+        transform->type = name[0] == 'k' ? TRANSFORM_KEEP : TRANSFORM_DROP;
+        transform->pattern = p;
+        int result = regcomp(&transform->regex, p, REG_EXTENDED | REG_NOSUB);
+        if (result != 0) {
+            char message[128];
+            regerror(result, &transform->regex, message, sizeof(message));
+            snprintf((char *)error, error_size, "regex: %s", message);
+            return 0;
+        }
+    } else {
+        snprintf((char *)error, error_size, "unknown transform %.*s", (int)name_len, name);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * transform_number
+ * leading decimal like sort -n, blanks, minus, digits and fraction
+ * no exponent, hex, inf or nan, line without number is 0
+ */
+double transform_number(unsigned char *bytes) {
+    unsigned char *p = bytes;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    unsigned char *head = p;
+    if (*p == '-')
+        p++;
+    int digits = 0;
+    while (*p >= '0' && *p <= '9') {
+        p++;
+        digits++;
+    }
+    if (*p == '.' && p[1] >= '0' && p[1] <= '9') {
+        p++;
+        while (*p >= '0' && *p <= '9') {
+            p++;
+            digits++;
+        }
+    }
+    if (!digits)
+        return 0;
+    // strtod reads only the checked part
+    unsigned char end = *p;
+    *p = '\0';
+    double number = strtod((char *)head, NULL);
+    *p = end;
+    return number;
+}
+
+/*
+ * transform_compare_key
+ * by number or ignoring case if option, or by bytes. 0 is same for -u
+ */
+int transform_compare_key(const struct transform_line *x, const struct transform_line *y, struct transform *transform) {
+    if (transform->is_numeric)
+        return x->number < y->number ? -1 : x->number > y->number ? 1 : 0;
+    if (transform->is_fold)
+        return strcasecmp((char *)x->bytes, (char *)y->bytes);
+    // utf-8 byte order is code point order
+    unum size = x->size < y->size ? x->size : y->size;
+    int result = memcmp(x->bytes, y->bytes, size);
+    if (result == 0 && x->size != y->size)
+        result = x->size < y->size ? -1 : 1;
+    return result;
+}
+
+/*
+ * transform_compare
+ * order of sort, same key is in original order
+ */
+int transform_compare(const void *a, const void *b, void *arg) {
+    const struct transform_line *x = (const struct transform_line *)a;
+    const struct transform_line *y = (const struct transform_line *)b;
+    struct transform *transform = (struct transform *)arg;
+    int result = transform_compare_key(x, y, transform);
+    if (transform->is_reverse)
+        result = -result;
+    if (result == 0 && x->index != y->index)
+        result = x->index < y->index ? -1 : 1;
+    return result;
+}
+
+/*
+ * transform_workers
+ * thread count for count rows
+ */
+unsigned int transform_workers(unum count) {
+    long cpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unum workers = count / TRANSFORM_MIN_ROWS;
+    if (cpu < 1)
+        cpu = 1;
+    if (workers > (unum)cpu)
+        workers = cpu;
+    if (workers > TRANSFORM_MAX_WORKERS)
+        workers = TRANSFORM_MAX_WORKERS;
+    return workers ? workers : 1;
+}
+
+/*
+ * transform_run
+ * divide count into worker_count ranges of jobs and wait all, first range runs in this thread
+ */
+void transform_run(struct transform *transform, unum count, void *(*work)(void *), struct transform_job *jobs, unsigned int worker_count) {
+    pthread_t threads[TRANSFORM_MAX_WORKERS];
+    unsigned int i;
+    for (i = 0; i < worker_count; i++) {
+        jobs[i].transform = transform;
+        jobs[i].begin = count * i / worker_count;
+        jobs[i].end = count * (i + 1) / worker_count;
+        jobs[i].part = i;
+        jobs[i].part_count = worker_count;
+        if (i > 0)
+            pthread_create(&threads[i], NULL, work, &jobs[i]);
+    }
+    work(&jobs[0]);
+    for (i = 1; i < worker_count; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/*
+ * transform_extract
+ * copy bytes of rows, and make key of each line
+ */
+void *transform_extract(void *arg) {
+    struct transform_job *job = (struct transform_job *)arg;
+    struct transform *transform = job->transform;
+    // regexec of glibc locks regex_t, each worker matches by own copy
+    regex_t own_regex;
+    regex_t *regex = &transform->regex;
+    if ((transform->type == TRANSFORM_KEEP || transform->type == TRANSFORM_DROP)
+            && regcomp(&own_regex, transform->pattern, REG_EXTENDED | REG_NOSUB) == 0)
+        regex = &own_regex;
+    unum total = 0;
+    unum i;
+    for (i = job->begin; i < job->end; i++)
+        total += transform->rows[i]->byte_count + 1;
+    job->buffer = (unsigned char *)malloc(total + 1);
+    unsigned char *p = job->buffer;
+    for (i = job->begin; i < job->end; i++) {
+        struct transform_line *line = &transform->lines[i];
+        line->bytes = p;
+        struct line *chunk;
+        for (chunk = transform->rows[i]->line; chunk; chunk = chunk->next) {
+            memcpy(p, chunk->string, chunk->byte_count);
+            p += chunk->byte_count;
+        }
+        line->size = p - line->bytes;
+        if (line->size && line->bytes[line->size - 1] == '\n')
+            line->size--;
+        if (transform->type == TRANSFORM_TRIM)
+            while (line->size && (line->bytes[line->size - 1] == ' ' || line->bytes[line->size - 1] == '\t'))
+                line->size--;
+        line->bytes[line->size] = '\0';
+        p = &line->bytes[line->size + 1];
+        line->index = i;
+        line->is_kept = 1;
+        if (transform->is_numeric)
+            line->number = transform_number(line->bytes);
+        if (transform->type == TRANSFORM_UNIQ) {
+            unum hash = FNV_OFFSET_BASIS;
+            unum k;
+            for (k = 0; k < line->size; k++)
+                hash = (hash ^ line->bytes[k]) * FNV_PRIME;
+            line->hash = hash;
+        }
+        if (transform->type == TRANSFORM_KEEP || transform->type == TRANSFORM_DROP) {
+            int is_match = regexec(regex, (char *)line->bytes, 0, NULL, 0) == 0;
+            line->is_kept = is_match == (transform->type == TRANSFORM_KEEP);
+        }
+    }
+    if (regex == &own_regex)
+        regfree(&own_regex);
+    return NULL;
+}
+
+/*
+ * transform_unique
+ * clear is_kept of lines of part same as former line, every line is in one part
+ */
+void *transform_unique(void *arg) {
+    struct transform_job *job = (struct transform_job *)arg;
+    struct transform *transform = job->transform;
+    struct transform_line *lines = transform->lines;
+    unum i, part_size = 0;
+    for (i = 0; i < transform->count; i++)
+        if ((lines[i].hash >> 32) % job->part_count == job->part)
+            part_size++;
+    unum capacity = 16;
+    while (capacity < part_size * 2)
+        capacity *= 2;
+    unum *table = (unum *)calloc(capacity, sizeof(unum));
+    for (i = 0; i < transform->count; i++) {
+        struct transform_line *line = &lines[i];
+        if ((line->hash >> 32) % job->part_count != job->part)
+            continue;
+        unum slot = line->hash & (capacity - 1);
+        while (table[slot]) {
+            struct transform_line *other = &lines[table[slot] - 1];
+            if (other->hash == line->hash && other->size == line->size && memcmp(other->bytes, line->bytes, line->size) == 0) {
+                line->is_kept = 0;
+                break;
+            }
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (line->is_kept)
+            table[slot] = i + 1;
+    }
+    free(table);
+    return NULL;
+}
+
+/*
+ * transform_sort
+ * sort range of job
+ */
+void *transform_sort(void *arg) {
+    struct transform_job *job = (struct transform_job *)arg;
+    qsort_r(&job->transform->lines[job->begin], job->end - job->begin, sizeof(struct transform_line),
+        transform_compare, job->transform);
+    return NULL;
+}
+
+/*
+ * transform_merge
+ * merge two sorted ranges of lines to temp
+ */
+void *transform_merge(void *arg) {
+    struct transform_job *job = (struct transform_job *)arg;
+    struct transform *transform = job->transform;
+    struct transform_line *lines = transform->lines;
+    unum a = job->begin;
+    unum b = job->middle;
+    unum out = job->begin;
+    while (a < job->middle && b < job->end)
+        transform->temp[out++] = transform_compare(&lines[a], &lines[b], transform) <= 0 ? lines[a++] : lines[b++];
+    while (a < job->middle)
+        transform->temp[out++] = lines[a++];
+    while (b < job->end)
+        transform->temp[out++] = lines[b++];
+    return NULL;
+}
+
+/*
+ * transform_build
+ * make rows of range of result, widths are calculated here
+ */
+void *transform_build(void *arg) {
+    struct transform_job *job = (struct transform_job *)arg;
+    struct transform *transform = job->transform;
+    job->head = NULL;
+    job->tail = NULL;
+    unum i;
+    for (i = job->begin; i < job->end; i++) {
+        struct transform_line *source = &transform->lines[i];
+        struct text *text = text_insert(job->tail);
+        if (!job->head)
+            job->head = text;
+        job->tail = text;
+        struct line *line = text->line;
+        line->position_count = 0;
+        unum size = source->size + (transform->is_tail && i + 1 == transform->count ? 0 : 1);
+        unum k = 0;
+        while (k < size) {
+            unsigned char *c = k < source->size ? &source->bytes[k] : (unsigned char *)"\n";
+            unsigned int s = safed_mbchar_size(c);
+            // same fill as line_add_char
+            if (line->byte_count + s >= BUFFER_SIZE) {
+                line = line_insert(line);
+                line->position_count = 0;
+            }
+            memcpy(&line->string[line->byte_count], c, s);
+            line->byte_count += s;
+            line->position_count++;
+            k += s;
+        }
+        calculation_text_width(text);
+    }
+    return NULL;
+}
+
+/*
+ * context_transform
+ * replace selected rows, or whole text, by result of transform at once
+ */
+void context_transform(struct context *context, unsigned char *text) {
+    struct transform transform;
+    if (!transform_parse(&transform, text, context->message, sizeof(context->message)))
+        return;
+    unum count = context_row_count(context);
+    unum top = 1;
+    unum bottom = count;
+    struct cursor start, end;
+    if (region_get(context, &start, &end)) {
+        top = start.position_y;
+        bottom = end.position_y;
+        // selection to head of row doesn't take the row
+        if (end.position_x == 1 && bottom > top)
+            bottom--;
+    }
+    // empty last row is end of file, not a line
+    if (bottom == count && bottom > top && context_text_at(context, bottom)->byte_count == 0)
+        bottom--;
+    clipboard_before_edit(context, top, bottom);
+    context_thaw_rows(context, top, bottom);
+    file_state_mark_dirty(context, top > 1 ? top - 1 : 1);
+    context->file_state.is_modified = 1;
+    context->version++;
+    context_text_at(context, top);
+    // rows of range are contiguous if gap is after them
+    row_index_gap_move(&context->row_index, bottom);
+    transform.rows = row_index_slot(&context->row_index, top - 1);
+    transform.count = bottom - top + 1;
+    transform.is_tail = bottom == count;
+    transform.lines = (struct transform_line *)malloc(sizeof(struct transform_line) * transform.count);
+    transform.temp = NULL;
+    unum input_count = transform.count;
+
+    unsigned int worker_count = transform_workers(transform.count);
+    struct transform_job jobs[TRANSFORM_MAX_WORKERS];
+    transform_run(&transform, transform.count, transform_extract, jobs, worker_count);
+    unum i, kept = 0;
+    if (transform.type == TRANSFORM_SORT) {
+        transform_run(&transform, transform.count, transform_sort, jobs, worker_count);
+        // pairs of sorted ranges are merged in parallel, until one range
+        transform.temp = (struct transform_line *)malloc(sizeof(struct transform_line) * transform.count);
+        unsigned int range_count = worker_count;
+        unum bounds[TRANSFORM_MAX_WORKERS + 1];
+        for (i = 0; i < worker_count; i++)
+            bounds[i] = jobs[i].begin;
+        bounds[worker_count] = transform.count;
+        while (range_count > 1) {
+            pthread_t threads[TRANSFORM_MAX_WORKERS];
+            struct transform_job merges[TRANSFORM_MAX_WORKERS];
+            unsigned int merge_count = 0;
+            unsigned int r;
+            for (r = 0; r < range_count; r += 2) {
+                struct transform_job *merge = &merges[merge_count];
+                merge->transform = &transform;
+                merge->begin = bounds[r];
+                // odd range is copied as it is
+                merge->middle = bounds[r + 1];
+                merge->end = r + 1 < range_count ? bounds[r + 2] : bounds[r + 1];
+                pthread_create(&threads[merge_count], NULL, transform_merge, merge);
+                bounds[merge_count] = merge->begin;
+                merge_count++;
+            }
+            for (r = 0; r < merge_count; r++)
+                pthread_join(threads[r], NULL);
+            bounds[merge_count] = transform.count;
+            range_count = merge_count;
+            struct transform_line *swap = transform.lines;
+            transform.lines = transform.temp;
+            transform.temp = swap;
+        }
+        if (transform.is_unique) {
+            // first one of same key is kept
+            for (i = 0; i < transform.count; i++)
+                if (kept == 0 || transform_compare_key(&transform.lines[kept - 1], &transform.lines[i], &transform) != 0)
+                    transform.lines[kept++] = transform.lines[i];
+            transform.count = kept;
+        }
+    } else if (transform.type == TRANSFORM_UNIQ) {
+        // same lines have same hash, parts of hash are deduped in parallel, first one is kept
+        struct transform_job parts[TRANSFORM_MAX_WORKERS];
+        transform_run(&transform, transform.count, transform_unique, parts, worker_count);
+        for (i = 0; i < transform.count; i++)
+            if (transform.lines[i].is_kept)
+                transform.lines[kept++] = transform.lines[i];
+        transform.count = kept;
+    } else if (transform.type == TRANSFORM_KEEP || transform.type == TRANSFORM_DROP) {
+        for (i = 0; i < transform.count; i++)
+            if (transform.lines[i].is_kept)
+                transform.lines[kept++] = transform.lines[i];
+        transform.count = kept;
+        regfree(&transform.regex);
+    } else if (transform.type == TRANSFORM_REVERSE) {
+        for (i = 0; i < transform.count / 2; i++) {
+            struct transform_line swap = transform.lines[i];
+            transform.lines[i] = transform.lines[transform.count - 1 - i];
+            transform.lines[transform.count - 1 - i] = swap;
+        }
+    }
+
+    struct text *head = NULL;
+    struct text *tail = NULL;
+    if (transform.count == 0 && transform.is_tail) {
+        // all lines are dropped, empty last row is left
+        head = text_malloc();
+        head->line->position_count = 0;
+        calculation_text_width(head);
+        tail = head;
+    } else if (transform.count > 0) {
+        unsigned int build_count = transform_workers(transform.count);
+        struct transform_job builds[TRANSFORM_MAX_WORKERS];
+        transform_run(&transform, transform.count, transform_build, builds, build_count);
+        head = builds[0].head;
+        tail = builds[0].tail;
+        for (i = 1; i < build_count; i++) {
+            if (!builds[i].head)
+                continue;
+            tail->next = builds[i].head;
+            builds[i].head->prev = tail;
+            tail = builds[i].tail;
+        }
+    }
+    // new rows in place of old rows
+    struct text *first = transform.rows[0];
+    struct text *last = transform.rows[input_count - 1];
+    struct text *prev = first->prev;
+    struct text *next = last->next;
+    if (!head) {
+        // rows are only removed
+        head = next;
+        tail = prev;
+    } else {
+        head->prev = prev;
+        tail->next = next;
+    }
+    if (prev)
+        prev->next = head;
+    else
+        context->text = head;
+    if (next)
+        next->prev = tail;
+    last->next = NULL;
+    text_list_free(first);
+    for (i = 0; i < worker_count; i++)
+        free(jobs[i].buffer);
+    free(transform.lines);
+    free(transform.temp);
+    row_index_invalidate(context);
+    context->mark_active = 0;
+    context->cursor.position_x = 1;
+    context->cursor.position_y = top;
+    snprintf((char *)context->message, sizeof(context->message), "%llu rows -> %llu rows", input_count, transform.count);
+}
+
 /*
  * render_header
  * output header with white background, width is windowsize
  */
 void render_header(struct context_header context) {
+    printf("\e[1;1H");
     backcolor_white(1);
     printf(" ");
 	trim_print(context.message, context.view_size.width - 2);
 	printf(" ");
     backcolor_white(0);
-    printf("\n");
 }
 
 void render_footer(struct context_footer context) {
+    // no \n at bottom, or screen scrolls
+    printf("\e[%u;1H", context.view_size.height);
     backcolor_white(1);
     printf(" ");
     trim_print(context.message, context.view_size.width - 2);
     printf(" ");
     backcolor_white(0);
-    printf("\n");
 }
 
 /* 
  * vailidate_render_position
- * match cursor_position and render_start_height
+ * match cursor_position and render_start_height, render_start_width
  */
 void vailidate_render_position(struct context *context) {
-    while (context->cursor.position_y <= context->render_start_height)
-        context->render_start_height -= 1;
-    while(context->cursor.position_y >= context->render_start_height + context->body_height)
-        context->render_start_height += 1;
+    if (context->cursor.position_y <= context->render_start_height)
+        context->render_start_height = context->cursor.position_y - 1;
+    if (context->cursor.position_y > context->render_start_height + context->body_height)
+        context->render_start_height = context->cursor.position_y - context->body_height;
+    struct text *text = context_text_at(context, context->cursor.position_y);
+    if (!text)
+        return;
+    // whole wide char under cursor is shown
+    unum left = text_column_at(text, context->cursor.position_x);
+    unum right = text_column_at(text, context->cursor.position_x + 1) - 1;
+    if (right < left)
+        right = left;
+    if (left <= context->render_start_width)
+        context->render_start_width = left - 1;
+    if (right > context->render_start_width + context->view_size.width)
+        context->render_start_width = right - context->view_size.width;
 }
 
 /*
@@ -855,6 +5911,8 @@ void vailidate_render_position(struct context *context) {
  * init context
  */
 void render_setting(struct context *context) {
+    // render uses copy of context, index must be built here
+    row_index_build(context);
     struct view_size view_size = console_size();
     context->view_size = view_size;
     context->header_height = 1;
@@ -862,76 +5920,395 @@ void render_setting(struct context *context) {
     context->body_height = context->view_size.height - 2;
     context->footer_height = 1;
     vailidate_render_position(context);
+    // stream is freed by input thread at end, render reads only the copy
+    struct stream_status *status = &context->stream_status;
+    status->is_active = context->stream != NULL;
+    if (context->stream) {
+        pthread_mutex_lock(&context->stream->mutex);
+        status->read_bytes = context->stream->read_bytes;
+        status->is_truncated = context->stream->is_truncated;
+        pthread_mutex_unlock(&context->stream->mutex);
+    }
+}
+
+/*
+ * render
+ * pass snapshot to render thread, input is not blocked by terminal
+ */
+void render(const struct context *context) {
+    // render_setting builds index, rows are only read from here
+    assert(context->row_index.is_valid);
+    struct renderer *renderer = context->renderer;
+    if (!renderer) {
+        render_frame(context);
+        return;
+    }
+    struct context *snapshot = snapshot_make(context);
+    pthread_mutex_lock(&renderer->mutex);
+    // not drawn one is old already
+    struct context *dropped = renderer->pending;
+    renderer->pending = snapshot;
+    pthread_cond_signal(&renderer->cond);
+    pthread_mutex_unlock(&renderer->mutex);
+    if (dropped)
+        snapshot_free(dropped);
+}
+
+/*
+ * renderer_start
+ * run render_thread
+ */
+struct renderer *renderer_start(void) {
+    struct renderer *renderer = (struct renderer *)malloc(sizeof(struct renderer));
+    pthread_mutex_init(&renderer->mutex, NULL);
+    pthread_cond_init(&renderer->cond, NULL);
+    renderer->pending = NULL;
+    renderer->is_stopped = 0;
+    pthread_create(&renderer->thread, NULL, render_thread, renderer);
+    return renderer;
+}
+
+/*
+ * renderer_stop
+ * wait frame being drawn and end render_thread, terminal is written by caller after it
+ */
+void renderer_stop(struct renderer *renderer) {
+    pthread_mutex_lock(&renderer->mutex);
+    renderer->is_stopped = 1;
+    pthread_cond_signal(&renderer->cond);
+    pthread_mutex_unlock(&renderer->mutex);
+    pthread_join(renderer->thread, NULL);
+    if (renderer->pending)
+        snapshot_free(renderer->pending);
+    pthread_mutex_destroy(&renderer->mutex);
+    pthread_cond_destroy(&renderer->cond);
+    free(renderer);
+}
+
+/*
+ * render_thread
+ * draw latest snapshot, at most one frame per RENDER_FRAME_NS
+ */
+void *render_thread(void *arg) {
+    struct renderer *renderer = (struct renderer *)arg;
+    while (1) {
+        pthread_mutex_lock(&renderer->mutex);
+        while (!renderer->pending && !renderer->is_stopped)
+            pthread_cond_wait(&renderer->cond, &renderer->mutex);
+        if (renderer->is_stopped) {
+            pthread_mutex_unlock(&renderer->mutex);
+            break;
+        }
+        struct context *snapshot = renderer->pending;
+        renderer->pending = NULL;
+        pthread_mutex_unlock(&renderer->mutex);
+        struct timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        render_frame(snapshot);
+        snapshot_free(snapshot);
+        // snapshots while sleeping are coalesced to latest one
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long rest = RENDER_FRAME_NS - ((now.tv_sec - start.tv_sec) * 1000000000LL + (now.tv_nsec - start.tv_nsec));
+        if (rest > 0) {
+            struct timespec wait = {0, rest};
+            nanosleep(&wait, NULL);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * snapshot_make
+ * copy of context for render, only rows in view are copied and cut after right edge of view
+ */
+struct context *snapshot_make(const struct context *context) {
+    struct context *snapshot = (struct context *)malloc(sizeof(struct context));
+    *snapshot = *context;
+    // pointers owned by input thread are not followed by render thread
+    snapshot->cold_store = NULL;
+    snapshot->renderer = NULL;
+    snapshot->text = NULL;
+    snapshot->stream = NULL;
+    snapshot->clipboard.head = NULL;
+    snapshot->clipboard.tail = NULL;
+    snapshot->clipboard.rows = NULL;
+    snapshot->clipboard.is_borrowed = 0;
+    snapshot->macro.commands = NULL;
+    snapshot->macro.count = 0;
+    snapshot->macro.capacity = 0;
+    snapshot->filename = (char *)malloc(strlen(context->filename) + 1);
+    strcpy(snapshot->filename, context->filename);
+    // only encoding is shown
+    memset(&snapshot->file_state, 0, sizeof(struct file_state));
+    snapshot->file_state.inotify_fd = -1;
+    snapshot->file_state.watch = -1;
+    snapshot->file_state.encoding = context->file_state.encoding;
+    snapshot->file_state.has_bom = context->file_state.has_bom;
+    unum top = context->render_start_height + 1;
+    unum right = context->render_start_width + context->view_size.width;
+    struct text **rows = (struct text **)malloc(sizeof(struct text *) * (context->body_height + 1));
+    unum count = 0;
+    struct text *source = row_index_at(&context->row_index, top);
+    struct text *tail = NULL;
+    for (; source && count < context->body_height; source = source->next) {
+        struct text *text = text_insert(tail);
+        text->width_count = source->width_count;
+        text->position_count = source->position_count;
+        text->byte_count = source->byte_count;
+        struct line *line = text->line;
+        line->position_count = 0;
+        // a char is 1 column at least
+        unum position = 0;
+        if (source->cold) {
+            unsigned char *bytes = cold_row_bytes(source);
+            unum i = 0;
+            while (i < source->byte_count && position <= right) {
+                unsigned int s = safed_mbchar_size(&bytes[i]);
+                if (line->byte_count + s >= BUFFER_SIZE) {
+                    line = line_insert(line);
+                    line->position_count = 0;
+                }
+                memcpy(&line->string[line->byte_count], &bytes[i], s);
+                line->byte_count += s;
+                line->position_count++;
+                position++;
+                i += s;
+            }
+        } else {
+            struct line *source_line;
+            for (source_line = source->line; source_line && position <= right; source_line = source_line->next) {
+                if (line->byte_count)
+                    line = line_insert(line);
+                memcpy(line->string, source_line->string, source_line->byte_count);
+                line->byte_count = source_line->byte_count;
+                line->position_count = source_line->position_count;
+                position += source_line->position_count;
+            }
+        }
+        if (!tail)
+            snapshot->text = text;
+        tail = text;
+        rows[count++] = text;
+    }
+    snapshot->row_index.rows = rows;
+    snapshot->row_index.count = count;
+    snapshot->row_index.capacity = context->body_height + 1;
+    snapshot->row_index.gap_start = count;
+    snapshot->row_index.is_valid = 1;
+    snapshot->row_index.base = context->render_start_height;
+    if (context->cursor_count) {
+        snapshot->cursors = (struct cursor *)malloc(sizeof(struct cursor) * context->cursor_count);
+        memcpy(snapshot->cursors, context->cursors, sizeof(struct cursor) * context->cursor_count);
+    } else {
+        snapshot->cursors = NULL;
+    }
+    return snapshot;
+}
+
+/*
+ * snapshot_free
+ * free copy made by snapshot_make
+ */
+void snapshot_free(struct context *snapshot) {
+    text_list_free(snapshot->text);
+    free(snapshot->row_index.rows);
+    free(snapshot->cursors);
+    free(snapshot->filename);
+    free(snapshot);
 }
 
 /*
+ * render_frame
  * output contents of context
+ * if only scrolled, move screen by scroll region and draw new rows
  */
-void render(struct context context) {
+void render_frame(const struct context *context) {
+    // last frame
+    static int is_drawn = 0;
+    static struct view_size prev_view_size;
+    static unum prev_version;
+    static unum prev_start;
+    static unum prev_start_width;
+    static struct cursor prev_cursor;
+    static int prev_is_plain;
+    static unsigned char prev_header[256];
+    static unsigned char prev_footer[256];
+
     struct context_header context_header;
-    context_header.message = (unsigned char *)context.filename;
-    context_header.view_size = context.view_size;
+    unsigned char header_message[256];
+    context_header.message = (unsigned char *)context->filename;
+    if (context->stream_status.is_active) {
+        snprintf((char *)header_message, sizeof(header_message), "%s (reading %llu bytes%s)", context->filename,
+            context->stream_status.read_bytes, context->stream_status.is_truncated ? ", stopped at budget" : "");
+        context_header.message = header_message;
+    } else if (context->file_state.encoding != ENCODING_UTF8 || context->file_state.has_bom) {
+        // written back in same encoding
+        snprintf((char *)header_message, sizeof(header_message), "%s [%s%s]", context->filename,
+            encoding_name(context->file_state.encoding), context->file_state.has_bom ? " BOM" : "");
+        context_header.message = header_message;
+    }
+    context_header.view_size = context->view_size;
     struct context_footer context_footer;
     unsigned char pathname[256];
 	getcwd((char *)pathname, 256);
-    context_footer.message = pathname;    context_footer.view_size = context.view_size;
-    clear();
-    render_header(context_header);
-    render_body(context);
-    render_footer(context_footer);
+    context_footer.message = context->message[0] ? (unsigned char *)context->message : pathname;    context_footer.view_size = context->view_size;
+
+    // selection and multi cursor are not tracked per row
+    int is_plain = !context->mark_active && context->cursor_count == 0 && context->rectangle.right <= context->rectangle.left;
+    long long delta = (long long)context->render_start_height - (long long)prev_start;
+    long long abs_delta = delta < 0 ? -delta : delta;
+    int is_partial = is_drawn && is_plain && prev_is_plain
+        && prev_view_size.width == context->view_size.width && prev_view_size.height == context->view_size.height
+        && prev_version == context->version && prev_start_width == context->render_start_width
+        // scroll and redraw is not cheaper for large jump
+        && abs_delta < context->body_height / 2;
+
+    if (is_partial) {
+        unum top = context->render_start_height + 1;
+        unum bottom = context->render_start_height + context->body_height;
+        // rows drawn by scroll
+        unum exposed_top = 1;
+        unum exposed_bottom = 0;
+        if (delta != 0) {
+            // header and footer are out of region
+            printf("\e[2;%ur", context->body_height + 1);
+            printf(delta > 0 ? "\e[%lldS" : "\e[%lldT", abs_delta);
+            printf("\e[r");
+            exposed_top = delta > 0 ? bottom - abs_delta + 1 : top;
+            exposed_bottom = delta > 0 ? bottom : top + abs_delta - 1;
+            unum y;
+            struct text *text = row_index_at(&context->row_index, exposed_top);
+            for (y = exposed_top; y <= exposed_bottom; y++) {
+                render_row(context, text, y);
+                if (text)
+                    text = text->next;
+            }
+        }
+        // cursor color moved
+        if (cursor_compare(prev_cursor, context->cursor) != 0) {
+            unum y = prev_cursor.position_y;
+            if (y >= top && y <= bottom && (y < exposed_top || y > exposed_bottom))
+                render_row(context, row_index_at(&context->row_index, y), y);
+            y = context->cursor.position_y;
+            if (y != prev_cursor.position_y && (y < exposed_top || y > exposed_bottom))
+                render_row(context, row_index_at(&context->row_index, y), y);
+        }
+        if (strcmp((char *)prev_header, (char *)context_header.message) != 0)
+            render_header(context_header);
+        if (strcmp((char *)prev_footer, (char *)context_footer.message) != 0)
+            render_footer(context_footer);
+    } else {
+        clear();
+        render_header(context_header);
+        render_body(context);
+        render_footer(context_footer);
+    }
+    fflush(stdout);
+    is_drawn = 1;
+    prev_view_size = context->view_size;
+    prev_version = context->version;
+    prev_start = context->render_start_height;
+    prev_start_width = context->render_start_width;
+    prev_cursor = context->cursor;
+    prev_is_plain = is_plain;
+    snprintf((char *)prev_header, sizeof(prev_header), "%s", context_header.message);
+    snprintf((char *)prev_footer, sizeof(prev_footer), "%s", context_footer.message);
     //debug_print_text(context);
 }
 
 /*
  * render_body
- * output with color cursor
+ * output rows in view
  */
-void render_body(struct context context) {
-    int height = context.body_height;
-    int render_max_height = context.render_start_height + height;
-    struct text *current_text = context.text;
-    struct line *current_line = context.text->line;
-    
-    unum pos_x = 1;
-    unum pos_y = 1;
-    unum wrote_byte;
+void render_body(const struct context *context) {
+    unum y = context->render_start_height + 1;
+    struct text *current_text = row_index_at(&context->row_index, y);
+    unsigned int i;
+    for (i = 0; i < context->body_height; i++, y++) {
+        render_row(context, current_text, y);
+        if (current_text)
+            current_text = current_text->next;
+    }
+}
+
+/*
+ * render_row
+ * output one row with color cursor at its screen row, columns from render_start_width in view width
+ */
+void render_row(const struct context *context, struct text *text, unum pos_y) {
+    printf("\e[%llu;1H\e[2K", pos_y - context->render_start_height + context->header_height);
+    if (!text)
+        return;
+    struct cursor region_start, region_end, pos;
+    int has_region = region_get(context, &region_start, &region_end);
+    const struct rectangle *rectangle = &context->rectangle;
+    int has_rectangle = rectangle->right > rectangle->left && pos_y >= rectangle->top && pos_y <= rectangle->bottom;
     int cursor_color_flag = 0;
-    while (current_text) {
-        current_line = current_text->line;
-        while (current_line) {
-            wrote_byte = 0;
-            // brank line
-            if (current_text->position_count <= 1 && context.cursor.position_y == pos_y) {
-                color_cursor(1);
-                printf(" ");
+    unum start = context->render_start_width;
+    unum end = start + context->view_size.width;
+    // display column of pos
+    unum column = 1;
+    pos.position_x = 1;
+    pos.position_y = pos_y;
+    struct line *current_line = text->line;
+    // compressed row is read as one segment without thaw
+    unsigned char *segment = text->cold ? cold_row_bytes(text) : NULL;
+    unum segment_size = text->cold ? text->byte_count : 0;
+    unsigned int wrote_byte;
+    while (segment || current_line) {
+        if (!segment) {
+            segment = current_line->string;
+            segment_size = current_line->byte_count;
+            current_line = current_line->next;
+        }
+        wrote_byte = 0;
+        while (wrote_byte < segment_size) {
+            unsigned char *c = &segment[wrote_byte];
+            unsigned int width = mbchar_width(c);
+            if (is_line_break(c) || column + width - 1 > end)
+                break;
+            if (column + width - 1 <= start) {
+                // left of view
+                wrote_byte += safed_mbchar_size(c);
+                column += width;
+                pos.position_x++;
+                continue;
+            }
+            if (cursor_color_flag) {
                 color_cursor(0);
+                cursor_color_flag = 0;
             }
-            while (wrote_byte < current_line->byte_count) {
-                if (render_max_height > pos_y && pos_y > context.render_start_height) {
-                    if (cursor_color_flag) {
-                        color_cursor(0);
-                        cursor_color_flag = 0;
-                    }
-                    if (context.cursor.position_x == pos_x && context.cursor.position_y == pos_y) {
-                        color_cursor(1);
-                        cursor_color_flag = 1;
-                    }
-                    wrote_byte += print_one_mbchar(&(current_line->string[wrote_byte]));
-                    pos_x++;
-                } else {
-                    wrote_byte++;
-                }
+            if (cursor_set_contains(context, pos)) {
+                color_cursor(1);
+                cursor_color_flag = 1;
+            } else if (has_region && cursor_compare(region_start, pos) <= 0 && cursor_compare(pos, region_end) < 0) {
+                backcolor_white(1);
+                cursor_color_flag = 1;
+            } else if (has_rectangle && column >= rectangle->left && column < rectangle->right) {
+                backcolor_white(1);
+                cursor_color_flag = 1;
             }
-            current_line = current_line->next;
+            if (column <= start) {
+                // wide char cut by left edge
+                printf("%*s", (int)(column + width - 1 - start), "");
+                wrote_byte += safed_mbchar_size(c);
+            } else {
+                wrote_byte += print_one_mbchar(c);
+            }
+            column += width;
+            pos.position_x++;
         }
-        current_text = current_text->next;
-        pos_y++;
-        height--;
-        pos_x = 1;
+        if (wrote_byte < segment_size)
+            break;
+        segment = NULL;
     }
-    while(height > 0) {
-        printf("\n");
-        height--;
+    if (cursor_color_flag)
+        color_cursor(0);
+    // cursor on tail or brank line
+    if (column > start && column <= end && cursor_set_contains(context, pos)) {
+        color_cursor(1);
+        printf(" ");
+        color_cursor(0);
     }
 }
 
@@ -941,6 +6318,12 @@ void render_body(struct context context) {
  */
 unsigned int print_one_mbchar(unsigned char *str) {
     unsigned int bytes = safed_mbchar_size(str);
+    // escaped byte is shown as hex, 2 columns
+    int value = escape_value(str);
+    if (value >= 0) {
+        printf("%02X", value);
+        return bytes;
+    }
     for (unsigned int i = 0; i < bytes; i++) {
         printf("%c", str[i]);
     }